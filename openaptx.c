@@ -20,10 +20,43 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#if defined(OPENAPTX_PROFILE) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#ifdef OPENAPTX_PROFILE
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+/*
+ * USDT static tracepoints are compiled in automatically when sys/sdt.h is
+ * available, unless disabled by defining OPENAPTX_USDT to 0.
+ */
+#if !defined(OPENAPTX_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define OPENAPTX_USDT 1
+#endif
+#endif
+
+#if defined(OPENAPTX_USDT) && OPENAPTX_USDT
+#include <sys/sdt.h>
+#define APTX_PROBE1(name, a1) DTRACE_PROBE1(openaptx, name, a1)
+#define APTX_PROBE2(name, a1, a2) DTRACE_PROBE2(openaptx, name, a1, a2)
+#define APTX_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(openaptx, name, a1, a2, a3)
+#else
+#define APTX_PROBE1(name, a1) ((void)0)
+#define APTX_PROBE2(name, a1, a2) ((void)0)
+#define APTX_PROBE3(name, a1, a2, a3) ((void)0)
+#endif
+
 #include <openaptx.h>
 
 #if (!defined(__STDC_VERSION__) || __STDC_VERSION__ < 199901L) && !defined(inline)
@@ -80,6 +113,20 @@ enum channels {
 #define FILTER_TAPS 16
 #define LATENCY_SAMPLES 90
 
+/*
+ * Number of aptX samples after which whole state of QMF synthesis tree is
+ * determined only by these samples. Inner filters need FILTER_TAPS samples
+ * and outer filter then FILTER_TAPS/2 samples of inner filters output.
+ */
+#define QMF_SYNTHESIS_PACKETS (FILTER_TAPS + FILTER_TAPS/2)
+
+/*
+ * Number of aptX samples after which whole state of QMF analysis tree is
+ * determined only by these samples. Outer filters need FILTER_TAPS/2 samples
+ * and inner filters then FILTER_TAPS samples of outer filters output.
+ */
+#define QMF_ANALYSIS_PACKETS (FILTER_TAPS/2 + FILTER_TAPS)
+
 struct aptx_filter_signal {
     int32_t buffer[2*FILTER_TAPS];
     uint8_t pos;
@@ -127,16 +174,67 @@ struct aptx_channel {
 struct aptx_context {
     size_t decode_sync_packets;
     size_t decode_dropped;
+    struct aptx_stats stats;
+    struct aptx_analysis *analysis;
+#ifdef OPENAPTX_PROFILE
+    uint64_t profile_mark;
+    struct aptx_profile profile;
+#endif
     struct aptx_channel channels[NB_CHANNELS];
     uint8_t hd;
     uint8_t sync_idx;
     uint8_t encode_remaining;
     uint8_t decode_skip_leading;
     uint8_t decode_sync_buffer_len;
+    uint8_t encode_mono;
+    uint8_t encode_silence;
     unsigned char decode_sync_buffer[6];
+    uint8_t error_tolerance;
+    uint16_t error_history;
 };
 
 
+#ifdef OPENAPTX_PROFILE
+
+/*
+ * Read CPU timestamp counter on x86, elsewhere monotonic time in nanoseconds.
+ */
+static inline uint64_t aptx_profile_ticks(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/*
+ * Account time elapsed from the previous mark to the stage and set new mark.
+ * Calls of stage are counted in processed aptX samples, so stage which runs
+ * separately for each channel counts its aptX sample only once and stage
+ * which runs for the whole block counts all aptX samples of block.
+ */
+static inline void aptx_profile_stage(struct aptx_context *ctx, enum aptx_profile_stage stage, size_t packets)
+{
+    const uint64_t ticks = aptx_profile_ticks();
+    ctx->profile.ticks[stage] += ticks - ctx->profile_mark;
+    ctx->profile.calls[stage] += packets;
+    ctx->profile_mark = ticks;
+}
+
+#define APTX_PROFILE_BEGIN(ctx) ((ctx)->profile_mark = aptx_profile_ticks())
+#define APTX_PROFILE_STAGE(ctx, stage, packets) aptx_profile_stage((ctx), (stage), (packets))
+
+#else
+
+#define APTX_PROFILE_BEGIN(ctx) ((void)0)
+#define APTX_PROFILE_STAGE(ctx, stage, packets) ((void)0)
+
+#endif
+
+
 static const int32_t quantize_intervals_LF[65] = {
       -9948,    9948,   29860,   49808,   69822,   89926,  110144,  130502,
      151026,  171738,  192666,  213832,  235264,  256982,  279014,  301384,
@@ -734,6 +832,209 @@ static void aptx_qmf_tree_synthesis(struct aptx_QMF_analysis *qmf,
                                      &samples[2*i]);
 }
 
+/*
+ * Maximal number of aptX samples processed together by encoding and decoding
+ * functions which process whole buffers.
+ */
+#define QMF_BLOCK_PACKETS 32
+
+/*
+ * Block QMF analysis and synthesis filter whole block of aptX samples at once,
+ * so inner loops over consecutive samples are vectorized by compiler. This is
+ * faster only with wider SIMD (e.g. -mavx2), in default build synthesis is
+ * slower than filtering aptX sample by aptX sample (see kernel block of
+ * openaptxbench). Block QMF can be enabled by defining OPENAPTX_QMF_BLOCK to 1.
+ */
+#ifndef OPENAPTX_QMF_BLOCK
+#define OPENAPTX_QMF_BLOCK 0
+#endif
+
+/*
+ * Push count samples into a circular signal buffer and compute convolution of
+ * the signal with the coefficients after every pushed sample, reduced to
+ * 24 bits by applying the specified right shifting. Signal is copied into
+ * linear history followed by new samples, so consecutive outputs are
+ * computed together and the inner loop over outputs is vectorized by
+ * compiler. Last FILTER_TAPS samples are then stored back into circular
+ * buffer at same positions as by aptx_qmf_filter_signal_push().
+ */
+static inline void aptx_qmf_block_convolution(struct aptx_filter_signal *signal,
+                                              const int32_t coeffs[FILTER_TAPS],
+                                              unsigned shift,
+                                              const int32_t *input,
+                                              size_t count,
+                                              int32_t *output)
+{
+    int32_t linear[FILTER_TAPS + 2*QMF_BLOCK_PACKETS];
+    int64_t e[2*QMF_BLOCK_PACKETS];
+    unsigned pos, i;
+    size_t n;
+
+    for (i = 0; i < FILTER_TAPS; i++)
+        linear[i] = signal->buffer[signal->pos + i];
+    for (n = 0; n < count; n++)
+        linear[FILTER_TAPS + n] = input[n];
+
+    for (n = 0; n < count; n++)
+        e[n] = 0;
+    for (i = 0; i < FILTER_TAPS; i++)
+        for (n = 0; n < count; n++)
+            e[n] += (int64_t)linear[n + 1 + i] * (int64_t)coeffs[i];
+    for (n = 0; n < count; n++)
+        output[n] = rshift64_clip24(e[n], shift);
+
+    pos = (unsigned)((signal->pos + count) & (FILTER_TAPS - 1));
+    for (i = 0; i < FILTER_TAPS; i++) {
+        signal->buffer[((pos + i) & (FILTER_TAPS - 1))            ] = linear[count + i];
+        signal->buffer[((pos + i) & (FILTER_TAPS - 1))+FILTER_TAPS] = linear[count + i];
+    }
+    signal->pos = (uint8_t)pos;
+}
+
+/*
+ * Two stage QMF analysis tree of one channel for block of at most
+ * QMF_BLOCK_PACKETS aptX samples. Whole block is processed by outer filters
+ * first and their output by inner filters, results are same as by calling
+ * aptx_qmf_tree_analysis() for every aptX sample.
+ */
+static inline void aptx_qmf_tree_analysis_block(struct aptx_QMF_analysis *qmf,
+                                                const int32_t samples[][NB_CHANNELS][4],
+                                                unsigned channel,
+                                                size_t packets,
+                                                int32_t subband_samples[][NB_CHANNELS][NB_SUBBANDS])
+{
+    int32_t input[NB_FILTERS][2*QMF_BLOCK_PACKETS];
+    int32_t output[NB_FILTERS][2*QMF_BLOCK_PACKETS];
+    int32_t intermediate_samples[2][2*QMF_BLOCK_PACKETS];
+    unsigned i, j;
+    size_t n;
+
+    /* Outer filter i gets samples 1-i and 3-i of every aptX sample */
+    for (n = 0; n < packets; n++) {
+        for (j = 0; j < 2; j++) {
+            input[0][2*n+j] = samples[n][channel][2*j+1];
+            input[1][2*n+j] = samples[n][channel][2*j+0];
+        }
+    }
+
+    for (i = 0; i < NB_FILTERS; i++)
+        aptx_qmf_block_convolution(&qmf->outer_filter_signal[i], aptx_qmf_outer_coeffs[i], 23,
+                                   input[i], 2*packets, output[i]);
+
+    for (n = 0; n < 2*packets; n++) {
+        intermediate_samples[0][n] = clip_intp2(output[0][n] + output[1][n], 23);
+        intermediate_samples[1][n] = clip_intp2(output[0][n] - output[1][n], 23);
+    }
+
+    /* Inner filters i get odd and even samples of intermediate subband */
+    for (i = 0; i < 2; i++) {
+        for (n = 0; n < packets; n++) {
+            input[0][n] = intermediate_samples[i][2*n+1];
+            input[1][n] = intermediate_samples[i][2*n+0];
+        }
+
+        for (j = 0; j < NB_FILTERS; j++)
+            aptx_qmf_block_convolution(&qmf->inner_filter_signal[i][j], aptx_qmf_inner_coeffs[j], 23,
+                                       input[j], packets, output[j]);
+
+        for (n = 0; n < packets; n++) {
+            subband_samples[n][channel][2*i+0] = clip_intp2(output[0][n] + output[1][n], 23);
+            subband_samples[n][channel][2*i+1] = clip_intp2(output[0][n] - output[1][n], 23);
+        }
+    }
+}
+
+/*
+ * Two stage QMF synthesis tree of one channel for block of at most
+ * QMF_BLOCK_PACKETS aptX samples. Results are same as by calling
+ * aptx_qmf_tree_synthesis() for every aptX sample.
+ */
+static inline void aptx_qmf_tree_synthesis_block(struct aptx_QMF_analysis *qmf,
+                                                 const int32_t subband_samples[][NB_CHANNELS][NB_SUBBANDS],
+                                                 unsigned channel,
+                                                 size_t packets,
+                                                 int32_t samples[][NB_CHANNELS][4])
+{
+    int32_t input[NB_FILTERS][2*QMF_BLOCK_PACKETS];
+    int32_t output[NB_FILTERS][2*QMF_BLOCK_PACKETS];
+    int32_t intermediate_samples[2][2*QMF_BLOCK_PACKETS];
+    unsigned i, j;
+    size_t n;
+
+    /* Join 4 subbands into 2 intermediate subbands upsampled to 2 samples. */
+    for (i = 0; i < 2; i++) {
+        for (n = 0; n < packets; n++) {
+            input[0][n] = subband_samples[n][channel][2*i+0] - subband_samples[n][channel][2*i+1];
+            input[1][n] = subband_samples[n][channel][2*i+0] + subband_samples[n][channel][2*i+1];
+        }
+
+        for (j = 0; j < NB_FILTERS; j++)
+            aptx_qmf_block_convolution(&qmf->inner_filter_signal[i][j], aptx_qmf_inner_coeffs[j], 22,
+                                       input[j], packets, output[j]);
+
+        for (n = 0; n < packets; n++) {
+            intermediate_samples[i][2*n+0] = output[0][n];
+            intermediate_samples[i][2*n+1] = output[1][n];
+        }
+    }
+
+    /* Join 2 samples from intermediate subbands upsampled to 4 samples. */
+    for (n = 0; n < 2*packets; n++) {
+        input[0][n] = intermediate_samples[0][n] - intermediate_samples[1][n];
+        input[1][n] = intermediate_samples[0][n] + intermediate_samples[1][n];
+    }
+
+    for (i = 0; i < NB_FILTERS; i++)
+        aptx_qmf_block_convolution(&qmf->outer_filter_signal[i], aptx_qmf_outer_coeffs[i], 21,
+                                   input[i], 2*packets, output[i]);
+
+    for (n = 0; n < packets; n++) {
+        for (j = 0; j < 2; j++) {
+            samples[n][channel][2*j+0] = output[0][2*n+j];
+            samples[n][channel][2*j+1] = output[1][2*n+j];
+        }
+    }
+}
+
+/*
+ * QMF synthesis of one channel for block of at most QMF_BLOCK_PACKETS aptX
+ * samples, by block QMF synthesis when enabled or aptX sample by aptX sample.
+ */
+static void aptx_qmf_tree_synthesis_packets(struct aptx_QMF_analysis *qmf,
+                                            const int32_t subband_samples[][NB_CHANNELS][NB_SUBBANDS],
+                                            unsigned channel,
+                                            size_t packets,
+                                            int32_t samples[][NB_CHANNELS][4])
+{
+#if OPENAPTX_QMF_BLOCK
+    aptx_qmf_tree_synthesis_block(qmf, subband_samples, channel, packets, samples);
+#else
+    size_t n;
+
+    for (n = 0; n < packets; n++)
+        aptx_qmf_tree_synthesis(qmf, subband_samples[n][channel], samples[n][channel]);
+#endif
+}
+
+/*
+ * Advance positions of QMF tree signal buffers as if samples of given number
+ * of aptX samples were pushed into them. Both analysis and synthesis push two
+ * samples per aptX sample into outer filters and one into inner filters.
+ * Content of buffers is not updated, for synthesis it is overwritten by next
+ * QMF_SYNTHESIS_PACKETS and for analysis it is used only for digital silence
+ * when buffers contain only zeros.
+ */
+static void aptx_qmf_tree_skip(struct aptx_QMF_analysis *qmf, size_t packets)
+{
+    unsigned i, j;
+
+    for (i = 0; i < NB_FILTERS; i++) {
+        qmf->outer_filter_signal[i].pos = (uint8_t)((qmf->outer_filter_signal[i].pos + 2*packets) & (FILTER_TAPS - 1));
+        for (j = 0; j < NB_FILTERS; j++)
+            qmf->inner_filter_signal[i][j].pos = (uint8_t)((qmf->inner_filter_signal[i][j].pos + packets) & (FILTER_TAPS - 1));
+    }
+}
+
 
 static inline int32_t aptx_bin_search(int32_t value, int32_t factor,
                                       const int32_t *intervals, int nb_intervals)
@@ -793,15 +1094,11 @@ static void aptx_quantize_difference(struct aptx_quantize *quantize,
     quantize->quantized_sample_parity_change = parity_change    ^ inv;
 }
 
-static void aptx_encode_channel(struct aptx_channel *channel, const int32_t samples[4], int hd)
+static void aptx_encode_channel(struct aptx_channel *channel, const int32_t subband_samples[NB_SUBBANDS], int hd)
 {
-    int32_t subband_samples[NB_SUBBANDS];
     int32_t diff;
     unsigned subband;
 
-    aptx_qmf_tree_analysis(&channel->qmf, samples, subband_samples);
-    aptx_generate_dither(channel);
-
     for (subband = 0; subband < NB_SUBBANDS; subband++) {
         diff = clip_intp2(subband_samples[subband] - channel->prediction[subband].predicted_sample, 23);
         aptx_quantize_difference(&channel->quantize[subband], diff,
@@ -822,11 +1119,32 @@ static void aptx_decode_channel(struct aptx_channel *channel, int32_t samples[4]
 }
 
 
+/*
+ * Update factor_select and quantization factor for the next sample. It depends
+ * only on quantized sample, not on dither nor on the prediction.
+ */
+static inline void aptx_update_quantization_factor(struct aptx_invert_quantize *invert_quantize,
+                                                   int32_t idx,
+                                                   const struct aptx_tables *tables)
+{
+    int32_t shift, factor_select;
+
+    /* update factor_select */
+    factor_select = 32620 * invert_quantize->factor_select;
+    factor_select = rshift32(factor_select + (tables->quantize_factor_select_offset[idx] * (1 << 15)), 15);
+    invert_quantize->factor_select = clip(factor_select, 0, tables->factor_max);
+
+    /* update quantization factor */
+    idx = (invert_quantize->factor_select & 0xFF) >> 3;
+    shift = (tables->factor_max - invert_quantize->factor_select) >> 8;
+    invert_quantize->quantization_factor = (quantization_factors[idx] << 11) >> shift;
+}
+
 static void aptx_invert_quantization(struct aptx_invert_quantize *invert_quantize,
                                      int32_t quantized_sample, int32_t dither,
                                      const struct aptx_tables *tables)
 {
-    int32_t qr, idx, shift, factor_select;
+    int32_t qr, idx;
 
     idx = (quantized_sample ^ -(quantized_sample < 0)) + 1;
     qr = tables->quantize_intervals[idx] / 2;
@@ -836,15 +1154,7 @@ static void aptx_invert_quantization(struct aptx_invert_quantize *invert_quantiz
     qr = rshift64_clip24(((int64_t)qr * ((int64_t)1<<32)) + (int64_t)dither * (int64_t)tables->invert_quantize_dither_factors[idx], 32);
     invert_quantize->reconstructed_difference = (int32_t)(((int64_t)invert_quantize->quantization_factor * (int64_t)qr) >> 19);
 
-    /* update factor_select */
-    factor_select = 32620 * invert_quantize->factor_select;
-    factor_select = rshift32(factor_select + (tables->quantize_factor_select_offset[idx] * (1 << 15)), 15);
-    invert_quantize->factor_select = clip(factor_select, 0, tables->factor_max);
-
-    /* update quantization factor */
-    idx = (invert_quantize->factor_select & 0xFF) >> 3;
-    shift = (tables->factor_max - invert_quantize->factor_select) >> 8;
-    invert_quantize->quantization_factor = (quantization_factors[idx] << 11) >> shift;
+    aptx_update_quantization_factor(invert_quantize, idx, tables);
 }
 
 static int32_t *aptx_reconstructed_differences_update(struct aptx_prediction *prediction,
@@ -1014,209 +1324,1424 @@ static void aptxhd_unpack_codeword(struct aptx_channel *channel, uint32_t codewo
                                           | aptx_quantized_parity(channel);
 }
 
-static void aptx_encode_samples(struct aptx_context *ctx,
-                                int32_t samples[NB_CHANNELS][4],
-                                uint8_t *output)
+/*
+ * Codeword fields (quantized samples) of block of at most QMF_BLOCK_PACKETS
+ * aptX samples. Every field has its own array over aptX samples, so block
+ * packing and unpacking apply same shifts and sign extension to consecutive
+ * elements and compiler vectorizes them. Field of HF subband contains
+ * transmitted parity bit, which differs from quantized sample of decoder
+ * until aptx_set_codeword_fields() corrects it by dither parity.
+ */
+struct aptx_codewords {
+    int32_t quantized_samples[NB_CHANNELS][NB_SUBBANDS][QMF_BLOCK_PACKETS];
+};
+
+/*
+ * Unpack and sign extend codewords of block of aptX samples.
+ */
+static void aptx_unpack_codewords(const struct aptx_context *ctx,
+                                  const uint8_t *input,
+                                  size_t packets,
+                                  struct aptx_codewords *codewords)
 {
+    int32_t (*fields)[QMF_BLOCK_PACKETS];
+    const uint8_t *in;
+    uint32_t codeword;
     unsigned channel;
-    for (channel = 0; channel < NB_CHANNELS; channel++)
-        aptx_encode_channel(&ctx->channels[channel], samples[channel], ctx->hd);
-
-    aptx_insert_sync(ctx->channels, &ctx->sync_idx);
+    size_t n;
 
     for (channel = 0; channel < NB_CHANNELS; channel++) {
-        aptx_invert_quantize_and_prediction(&ctx->channels[channel], ctx->hd);
+        fields = codewords->quantized_samples[channel];
         if (ctx->hd) {
-            uint32_t codeword = aptxhd_pack_codeword(&ctx->channels[channel]);
-            output[3*channel+0] = (uint8_t)((codeword >> 16) & 0xFF);
-            output[3*channel+1] = (uint8_t)((codeword >>  8) & 0xFF);
-            output[3*channel+2] = (uint8_t)((codeword >>  0) & 0xFF);
+            for (n = 0, in = input + 3*channel; n < packets; n++, in += 6) {
+                codeword = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 0);
+                fields[0][n] = sign_extend((int32_t)(codeword >>  0), 9);
+                fields[1][n] = sign_extend((int32_t)(codeword >>  9), 6);
+                fields[2][n] = sign_extend((int32_t)(codeword >> 15), 4);
+                fields[3][n] = sign_extend((int32_t)(codeword >> 19), 5);
+            }
         } else {
-            uint16_t codeword = aptx_pack_codeword(&ctx->channels[channel]);
-            output[2*channel+0] = (uint8_t)((codeword >> 8) & 0xFF);
-            output[2*channel+1] = (uint8_t)((codeword >> 0) & 0xFF);
+            for (n = 0, in = input + 2*channel; n < packets; n++, in += 4) {
+                codeword = ((uint32_t)in[0] << 8) | ((uint32_t)in[1] << 0);
+                fields[0][n] = sign_extend((int32_t)(codeword >>  0), 7);
+                fields[1][n] = sign_extend((int32_t)(codeword >>  7), 4);
+                fields[2][n] = sign_extend((int32_t)(codeword >> 11), 2);
+                fields[3][n] = sign_extend((int32_t)(codeword >> 13), 3);
+            }
         }
     }
 }
 
-static int aptx_decode_samples(struct aptx_context *ctx,
-                                const uint8_t *input,
-                                int32_t samples[NB_CHANNELS][4])
+/*
+ * Pack codewords of block of aptX samples, inverse of aptx_unpack_codewords().
+ */
+static void aptx_pack_codewords(const struct aptx_context *ctx,
+                                const struct aptx_codewords *codewords,
+                                size_t packets,
+                                uint8_t *output)
 {
+    const int32_t (*fields)[QMF_BLOCK_PACKETS];
+    uint32_t codeword;
+    uint8_t *out;
     unsigned channel;
-    int ret;
+    size_t n;
 
     for (channel = 0; channel < NB_CHANNELS; channel++) {
-        aptx_generate_dither(&ctx->channels[channel]);
-
-        if (ctx->hd)
-            aptxhd_unpack_codeword(&ctx->channels[channel],
-                                   ((uint32_t)input[3*channel+0] << 16) |
-                                   ((uint32_t)input[3*channel+1] <<  8) |
-                                   ((uint32_t)input[3*channel+2] <<  0));
-        else
-            aptx_unpack_codeword(&ctx->channels[channel], (uint16_t)(
-                                 ((uint16_t)input[2*channel+0] << 8) |
-                                 ((uint16_t)input[2*channel+1] << 0)));
-        aptx_invert_quantize_and_prediction(&ctx->channels[channel], ctx->hd);
+        fields = codewords->quantized_samples[channel];
+        if (ctx->hd) {
+            for (n = 0, out = output + 3*channel; n < packets; n++, out += 6) {
+                codeword = ((uint32_t)(fields[3][n] & 0x01F) << 19)
+                         | ((uint32_t)(fields[2][n] & 0x00F) << 15)
+                         | ((uint32_t)(fields[1][n] & 0x03F) <<  9)
+                         | ((uint32_t)(fields[0][n] & 0x1FF) <<  0);
+                out[0] = (uint8_t)((codeword >> 16) & 0xFF);
+                out[1] = (uint8_t)((codeword >>  8) & 0xFF);
+                out[2] = (uint8_t)((codeword >>  0) & 0xFF);
+            }
+        } else {
+            for (n = 0, out = output + 2*channel; n < packets; n++, out += 4) {
+                codeword = ((uint32_t)(fields[3][n] & 0x07) << 13)
+                         | ((uint32_t)(fields[2][n] & 0x03) << 11)
+                         | ((uint32_t)(fields[1][n] & 0x0F) <<  7)
+                         | ((uint32_t)(fields[0][n] & 0x7F) <<  0);
+                out[0] = (uint8_t)((codeword >> 8) & 0xFF);
+                out[1] = (uint8_t)((codeword >> 0) & 0xFF);
+            }
+        }
     }
-
-    ret = aptx_check_parity(ctx->channels, &ctx->sync_idx);
-
-    for (channel = 0; channel < NB_CHANNELS; channel++)
-        aptx_decode_channel(&ctx->channels[channel], samples[channel]);
-
-    return ret;
 }
 
-static void aptx_reset_decode_sync(struct aptx_context *ctx)
+/*
+ * Store quantized samples of channel as codeword fields of aptX sample n,
+ * with parity bit of HF subband set like by aptx_pack_codeword().
+ */
+static inline void aptx_get_codeword_fields(const struct aptx_channel *channel,
+                                            struct aptx_codewords *codewords,
+                                            unsigned channel_idx,
+                                            size_t n)
 {
-    const size_t decode_dropped = ctx->decode_dropped;
-    const size_t decode_sync_packets = ctx->decode_sync_packets;
-    const uint8_t decode_sync_buffer_len = ctx->decode_sync_buffer_len;
-    unsigned char decode_sync_buffer[6];
-    unsigned i;
-
-    for (i = 0; i < 6; i++)
-        decode_sync_buffer[i] = ctx->decode_sync_buffer[i];
-
-    aptx_reset(ctx);
+    int32_t (*fields)[QMF_BLOCK_PACKETS] = codewords->quantized_samples[channel_idx];
 
-    for (i = 0; i < 6; i++)
-        ctx->decode_sync_buffer[i] = decode_sync_buffer[i];
-
-    ctx->decode_sync_buffer_len = decode_sync_buffer_len;
-    ctx->decode_sync_packets = decode_sync_packets;
-    ctx->decode_dropped = decode_dropped;
+    fields[0][n] = channel->quantize[0].quantized_sample;
+    fields[1][n] = channel->quantize[1].quantized_sample;
+    fields[2][n] = channel->quantize[2].quantized_sample;
+    fields[3][n] = (channel->quantize[3].quantized_sample & ~1) | aptx_quantized_parity(channel);
 }
 
+/*
+ * Set quantized samples of channel from codeword fields of aptX sample n,
+ * with parity bit of HF subband corrected like by aptx_unpack_codeword().
+ */
+static inline void aptx_set_codeword_fields(struct aptx_channel *channel,
+                                            const struct aptx_codewords *codewords,
+                                            unsigned channel_idx,
+                                            size_t n)
+{
+    const int32_t (*fields)[QMF_BLOCK_PACKETS] = codewords->quantized_samples[channel_idx];
 
-const int aptx_major = OPENAPTX_MAJOR;
-const int aptx_minor = OPENAPTX_MINOR;
-const int aptx_patch = OPENAPTX_PATCH;
+    channel->quantize[0].quantized_sample = fields[0][n];
+    channel->quantize[1].quantized_sample = fields[1][n];
+    channel->quantize[2].quantized_sample = fields[2][n];
+    channel->quantize[3].quantized_sample = fields[3][n];
+    channel->quantize[3].quantized_sample = (channel->quantize[3].quantized_sample & ~1)
+                                          | aptx_quantized_parity(channel);
+}
 
-struct aptx_context *aptx_init(int hd)
+/*
+ * Quantize subband samples of one aptX sample, everything after QMF analysis
+ * except packing of codewords.
+ */
+static void aptx_quantize_subband_samples(struct aptx_context *ctx,
+                                          const int32_t subband_samples[NB_CHANNELS][NB_SUBBANDS])
 {
-    struct aptx_context *ctx;
+    unsigned channel;
 
-    ctx = (struct aptx_context *)malloc(sizeof(*ctx));
-    if (!ctx)
-        return NULL;
+    ctx->stats.encoded++;
 
-    ctx->hd = hd ? 1 : 0;
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        aptx_generate_dither(&ctx->channels[channel]);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_DITHER, channel == LEFT);
+        aptx_encode_channel(&ctx->channels[channel], subband_samples[channel], ctx->hd);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_QUANTIZE, channel == LEFT);
+    }
 
-    aptx_reset(ctx);
-    return ctx;
+    aptx_insert_sync(ctx->channels, &ctx->sync_idx);
+    APTX_PROFILE_STAGE(ctx, APTX_PROFILE_INSERT_SYNC, 1);
+
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        aptx_invert_quantize_and_prediction(&ctx->channels[channel], ctx->hd);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_INVERT_QUANTIZE, channel == LEFT);
+    }
 }
 
-void aptx_reset(struct aptx_context *ctx)
+/*
+ * Encode subband samples of one aptX sample, everything after QMF analysis.
+ */
+static void aptx_encode_subband_samples(struct aptx_context *ctx,
+                                        const int32_t subband_samples[NB_CHANNELS][NB_SUBBANDS],
+                                        uint8_t *output)
 {
-    const uint8_t hd = ctx->hd;
-    unsigned i, chan, subband;
-    struct aptx_channel *channel;
-    struct aptx_prediction *prediction;
-
-    for (i = 0; i < sizeof(*ctx); i++)
-        ((unsigned char *)ctx)[i] = 0;
+    unsigned channel;
 
-    ctx->hd = hd;
-    ctx->decode_skip_leading = (LATENCY_SAMPLES+3)/4;
-    ctx->encode_remaining = (LATENCY_SAMPLES+3)/4;
+    aptx_quantize_subband_samples(ctx, subband_samples);
 
-    for (chan = 0; chan < NB_CHANNELS; chan++) {
-        channel = &ctx->channels[chan];
-        for (subband = 0; subband < NB_SUBBANDS; subband++) {
-            prediction = &channel->prediction[subband];
-            prediction->prev_sign[0] = 1;
-            prediction->prev_sign[1] = 1;
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        if (ctx->hd) {
+            uint32_t codeword = aptxhd_pack_codeword(&ctx->channels[channel]);
+            output[3*channel+0] = (uint8_t)((codeword >> 16) & 0xFF);
+            output[3*channel+1] = (uint8_t)((codeword >>  8) & 0xFF);
+            output[3*channel+2] = (uint8_t)((codeword >>  0) & 0xFF);
+        } else {
+            uint16_t codeword = aptx_pack_codeword(&ctx->channels[channel]);
+            output[2*channel+0] = (uint8_t)((codeword >> 8) & 0xFF);
+            output[2*channel+1] = (uint8_t)((codeword >> 0) & 0xFF);
         }
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_PACK, channel == LEFT);
     }
 }
 
-void aptx_finish(struct aptx_context *ctx)
+static inline int aptx_samples_mono(const int32_t samples[NB_CHANNELS][4])
 {
-    free(ctx);
+    return samples[LEFT][0] == samples[RIGHT][0] && samples[LEFT][1] == samples[RIGHT][1] &&
+           samples[LEFT][2] == samples[RIGHT][2] && samples[LEFT][3] == samples[RIGHT][3];
 }
 
-size_t aptx_encode(struct aptx_context *ctx, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written)
+static inline int aptx_samples_silent(const int32_t samples[NB_CHANNELS][4])
+{
+    return (samples[LEFT][0] | samples[LEFT][1] | samples[LEFT][2] | samples[LEFT][3]) == 0;
+}
+
+/*
+ * Count consecutive aptX samples with identical channels and with digital
+ * silence, up to QMF_ANALYSIS_PACKETS.
+ */
+static inline void aptx_qmf_stereo_count(struct aptx_context *ctx, int mono, int silent)
+{
+    if (!mono)
+        ctx->encode_mono = 0;
+    else if (ctx->encode_mono < QMF_ANALYSIS_PACKETS)
+        ctx->encode_mono++;
+
+    if (!silent)
+        ctx->encode_silence = 0;
+    else if (ctx->encode_silence < QMF_ANALYSIS_PACKETS)
+        ctx->encode_silence++;
+}
+
+/*
+ * QMF analysis of both channels. When both channels were identical for the
+ * last QMF_ANALYSIS_PACKETS aptX samples, their QMF states are identical too,
+ * so analysis is done only for left channel and state of right channel is
+ * not updated. It is restored from left channel when channels start to
+ * differ, therefore output is same as by analysis of each channel. When
+ * input was digital silence for the last QMF_ANALYSIS_PACKETS aptX samples,
+ * all QMF signal buffers contain zeros, so output is zero and only buffer
+ * positions are advanced.
+ */
+static void aptx_qmf_stereo_analysis(struct aptx_context *ctx,
+                                     const int32_t samples[NB_CHANNELS][4],
+                                     int32_t subband_samples[NB_CHANNELS][NB_SUBBANDS])
+{
+    unsigned channel, i;
+    int mono, silent;
+
+    mono = aptx_samples_mono(samples);
+    silent = mono && aptx_samples_silent(samples);
+
+    if (mono && ctx->encode_mono == QMF_ANALYSIS_PACKETS) {
+        if (silent && ctx->encode_silence == QMF_ANALYSIS_PACKETS) {
+            aptx_qmf_tree_skip(&ctx->channels[LEFT].qmf, 1);
+            for (i = 0; i < NB_SUBBANDS; i++)
+                subband_samples[LEFT][i] = 0;
+        } else {
+            aptx_qmf_tree_analysis(&ctx->channels[LEFT].qmf, samples[LEFT], subband_samples[LEFT]);
+        }
+        for (i = 0; i < NB_SUBBANDS; i++)
+            subband_samples[RIGHT][i] = subband_samples[LEFT][i];
+    } else {
+        if (ctx->encode_mono == QMF_ANALYSIS_PACKETS)
+            ctx->channels[RIGHT].qmf = ctx->channels[LEFT].qmf;
+
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            aptx_qmf_tree_analysis(&ctx->channels[channel].qmf, samples[channel], subband_samples[channel]);
+    }
+
+    aptx_qmf_stereo_count(ctx, mono, silent);
+}
+
+/*
+ * QMF analysis of both channels of block of at most QMF_BLOCK_PACKETS aptX
+ * samples. Block is analyzed by aptx_qmf_stereo_analysis() sample by sample
+ * when block QMF is disabled or when both channels are identical, so analysis
+ * of right channel or of silence is still skipped. Otherwise both channels
+ * are analyzed by block QMF analysis. Caller measures whole block as one QMF
+ * analysis stage.
+ */
+static void aptx_qmf_stereo_analysis_block(struct aptx_context *ctx,
+                                           const int32_t samples[][NB_CHANNELS][4],
+                                           size_t packets,
+                                           int32_t subband_samples[][NB_CHANNELS][NB_SUBBANDS])
+{
+    unsigned channel;
+    size_t n;
+
+#if OPENAPTX_QMF_BLOCK
+    for (n = 0; n < packets && aptx_samples_mono(samples[n]); n++);
+#else
+    n = packets;
+#endif
+
+    if (n == packets) {
+        for (n = 0; n < packets; n++)
+            aptx_qmf_stereo_analysis(ctx, samples[n], subband_samples[n]);
+        return;
+    }
+
+    if (ctx->encode_mono == QMF_ANALYSIS_PACKETS)
+        ctx->channels[RIGHT].qmf = ctx->channels[LEFT].qmf;
+
+    for (channel = 0; channel < NB_CHANNELS; channel++)
+        aptx_qmf_tree_analysis_block(&ctx->channels[channel].qmf, samples, channel, packets, subband_samples);
+
+    for (n = 0; n < packets; n++)
+        aptx_qmf_stereo_count(ctx, aptx_samples_mono(samples[n]),
+                              aptx_samples_mono(samples[n]) && aptx_samples_silent(samples[n]));
+}
+
+static void aptx_encode_samples(struct aptx_context *ctx,
+                                int32_t samples[NB_CHANNELS][4],
+                                uint8_t *output)
+{
+    int32_t subband_samples[NB_CHANNELS][NB_SUBBANDS];
+
+    APTX_PROFILE_BEGIN(ctx);
+
+    aptx_qmf_stereo_analysis(ctx, samples, subband_samples);
+    APTX_PROFILE_STAGE(ctx, APTX_PROFILE_QMF_ANALYSIS, 1);
+
+    aptx_encode_subband_samples(ctx, subband_samples, output);
+}
+
+/*
+ * Encode one aptX sample by two contexts, QMF analysis is done only by the
+ * first context and its result is quantized by both contexts. Context with
+ * NULL output pointer is skipped, but QMF analysis of the first context is
+ * always done as the second context depends on it.
+ */
+static void aptx_encode_dual_samples(struct aptx_context *ctx,
+                                     struct aptx_context *ctx2,
+                                     int32_t samples[NB_CHANNELS][4],
+                                     uint8_t *output,
+                                     uint8_t *output2)
+{
+    int32_t subband_samples[NB_CHANNELS][NB_SUBBANDS];
+
+    APTX_PROFILE_BEGIN(ctx);
+
+    aptx_qmf_stereo_analysis(ctx, samples, subband_samples);
+    APTX_PROFILE_STAGE(ctx, APTX_PROFILE_QMF_ANALYSIS, 1);
+
+    if (output)
+        aptx_encode_subband_samples(ctx, subband_samples, output);
+
+    if (output2) {
+        APTX_PROFILE_BEGIN(ctx2);
+        aptx_encode_subband_samples(ctx2, subband_samples, output2);
+    }
+}
+
+static inline void aptx_read_samples(const uint8_t *input, int32_t samples[NB_CHANNELS][4])
 {
-    const size_t sample_size = ctx->hd ? 6 : 4;
-    int32_t samples[NB_CHANNELS][4];
     unsigned sample, channel;
+
+    for (sample = 0; sample < 4; sample++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++, input += 3) {
+            /* samples need to contain 24bit signed integer stored as 32bit signed integers */
+            /* last int8_t --> uint32_t cast propagates signedness for 32bit integer */
+            samples[channel][sample] = (int32_t)(((uint32_t)input[0] << 0) |
+                                                 ((uint32_t)input[1] << 8) |
+                                                 ((uint32_t)(int8_t)input[2] << 16));
+        }
+    }
+}
+
+static inline void aptx_unpack_channel(struct aptx_context *ctx,
+                                       unsigned channel,
+                                       const uint8_t *input)
+{
+    if (ctx->hd)
+        aptxhd_unpack_codeword(&ctx->channels[channel],
+                               ((uint32_t)input[3*channel+0] << 16) |
+                               ((uint32_t)input[3*channel+1] <<  8) |
+                               ((uint32_t)input[3*channel+2] <<  0));
+    else
+        aptx_unpack_codeword(&ctx->channels[channel], (uint16_t)(
+                             ((uint16_t)input[2*channel+0] << 8) |
+                             ((uint16_t)input[2*channel+1] << 0)));
+}
+
+/*
+ * Decode one aptX sample up to the reconstructed subband samples without QMF
+ * synthesis. Prediction state of all subbands, dither and parity sync are
+ * updated exactly like by full decoding.
+ */
+static int aptx_decode_packet(struct aptx_context *ctx, const uint8_t *input)
+{
+    unsigned channel;
+    int ret;
+
+    APTX_PROFILE_BEGIN(ctx);
+
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        aptx_generate_dither(&ctx->channels[channel]);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_DITHER, channel == LEFT);
+        aptx_unpack_channel(ctx, channel, input);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_UNPACK, channel == LEFT);
+        aptx_invert_quantize_and_prediction(&ctx->channels[channel], ctx->hd);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_INVERT_QUANTIZE, channel == LEFT);
+    }
+
+    ret = aptx_check_parity(ctx->channels, &ctx->sync_idx);
+    APTX_PROFILE_STAGE(ctx, APTX_PROFILE_CHECK_PARITY, 1);
+    if (ret)
+        APTX_PROBE2(parity_error, ctx, ctx->sync_idx);
+
+    return ret;
+}
+
+/*
+ * Same as aptx_decode_packet() for aptX sample n of block whose codewords
+ * were already unpacked by aptx_unpack_codewords().
+ */
+static int aptx_decode_codewords(struct aptx_context *ctx,
+                                 const struct aptx_codewords *codewords,
+                                 size_t n)
+{
+    unsigned channel;
+    int ret;
+
+    APTX_PROFILE_BEGIN(ctx);
+
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        aptx_generate_dither(&ctx->channels[channel]);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_DITHER, channel == LEFT);
+        aptx_set_codeword_fields(&ctx->channels[channel], codewords, channel, n);
+        /* aptX sample was already counted by aptx_unpack_codewords() */
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_UNPACK, 0);
+        aptx_invert_quantize_and_prediction(&ctx->channels[channel], ctx->hd);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_INVERT_QUANTIZE, channel == LEFT);
+    }
+
+    ret = aptx_check_parity(ctx->channels, &ctx->sync_idx);
+    APTX_PROFILE_STAGE(ctx, APTX_PROFILE_CHECK_PARITY, 1);
+    if (ret)
+        APTX_PROBE2(parity_error, ctx, ctx->sync_idx);
+
+    return ret;
+}
+
+/*
+ * Decode only LF subband of one aptX sample. All subbands are still unpacked
+ * as dither and parity check depend on them, but invert quantization and
+ * prediction of other subbands are skipped. LF subband has gain 1/sqrt(2)
+ * compared to input of QMF analysis, so it is scaled back by 181/128.
+ */
+static int aptx_decode_preview_samples(struct aptx_context *ctx,
+                                       const uint8_t *input,
+                                       int32_t samples[NB_CHANNELS])
+{
+    struct aptx_channel *channel;
+    unsigned i;
+
+    for (i = 0; i < NB_CHANNELS; i++) {
+        channel = &ctx->channels[i];
+        aptx_generate_dither(channel);
+        aptx_unpack_channel(ctx, i, input);
+        aptx_process_subband(&channel->invert_quantize[0],
+                             &channel->prediction[0],
+                             channel->quantize[0].quantized_sample,
+                             channel->dither[0],
+                             &all_tables[ctx->hd][0]);
+        samples[i] = clip_intp2((int32_t)(((int64_t)channel->prediction[0].previous_reconstructed_sample * 181) >> 7), 23);
+    }
+
+    return aptx_check_parity(ctx->channels, &ctx->sync_idx);
+}
+
+/*
+ * Update only quantization factors of all subbands of one aptX sample.
+ */
+static int aptx_decode_levels_samples(struct aptx_context *ctx, const uint8_t *input)
+{
+    struct aptx_channel *channel;
+    int32_t quantized_sample;
+    unsigned i, subband;
+
+    for (i = 0; i < NB_CHANNELS; i++) {
+        channel = &ctx->channels[i];
+        aptx_generate_dither(channel);
+        aptx_unpack_channel(ctx, i, input);
+        for (subband = 0; subband < NB_SUBBANDS; subband++) {
+            quantized_sample = channel->quantize[subband].quantized_sample;
+            aptx_update_quantization_factor(&channel->invert_quantize[subband],
+                                            (quantized_sample ^ -(quantized_sample < 0)) + 1,
+                                            &all_tables[ctx->hd][subband]);
+        }
+    }
+
+    return aptx_check_parity(ctx->channels, &ctx->sync_idx);
+}
+
+/*
+ * Parity of one aptX sample taken directly from its transmitted codewords.
+ * Unpacking sets parity of quantized samples of each channel to the transmitted
+ * bit, so the parity check does not depend on dither nor on any decoder state.
+ */
+static inline int aptx_packet_parity(int hd, const uint8_t *input)
+{
+    if (hd)
+        return ((input[0] ^ input[3]) >> 3) & 1;
+    else
+        return ((input[0] ^ input[2]) >> 5) & 1;
+}
+
+static int aptx_decode_samples(struct aptx_context *ctx,
+                                const uint8_t *input,
+                                int32_t samples[NB_CHANNELS][4])
+{
+    unsigned channel;
+    int ret;
+
+    ret = aptx_decode_packet(ctx, input);
+
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        aptx_decode_channel(&ctx->channels[channel], samples[channel]);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_QMF_SYNTHESIS, channel == LEFT);
+    }
+
+    return ret;
+}
+
+static void aptx_reset_decode_sync(struct aptx_context *ctx)
+{
+    const size_t decode_dropped = ctx->decode_dropped;
+    const size_t decode_sync_packets = ctx->decode_sync_packets;
+    const uint8_t decode_sync_buffer_len = ctx->decode_sync_buffer_len;
+    unsigned char decode_sync_buffer[6];
+    unsigned i;
+
+    APTX_PROBE2(reset_decode_sync, ctx, decode_dropped);
+
+    for (i = 0; i < 6; i++)
+        decode_sync_buffer[i] = ctx->decode_sync_buffer[i];
+
+    aptx_reset(ctx);
+
+    for (i = 0; i < 6; i++)
+        ctx->decode_sync_buffer[i] = decode_sync_buffer[i];
+
+    ctx->decode_sync_buffer_len = decode_sync_buffer_len;
+    ctx->decode_sync_packets = decode_sync_packets;
+    ctx->decode_dropped = decode_dropped;
+}
+
+/*
+ * Account lost synchronization, called before the first byte is dropped.
+ */
+static void aptx_stats_sync_lost(struct aptx_context *ctx)
+{
+    if (ctx->decode_dropped == 0)
+        ctx->stats.sync_lost++;
+}
+
+/*
+ * Account regained synchronization and number of bytes dropped to regain it.
+ */
+static void aptx_stats_sync_regained(struct aptx_context *ctx)
+{
+    size_t dropped = ctx->decode_dropped;
+    unsigned bucket = 0;
+
+    while (dropped > 1 && bucket < APTX_STATS_RESYNC_BUCKETS-1) {
+        dropped >>= 1;
+        bucket++;
+    }
+
+    APTX_PROBE2(sync_regained, ctx, ctx->decode_dropped);
+
+    ctx->stats.sync_regained++;
+    ctx->stats.resync_dropped[bucket]++;
+    ctx->stats.dropped += ctx->decode_dropped;
+}
+
+
+#define APTX_CONTEXT_VERSION 1
+
+static unsigned char *aptx_save_uint64(unsigned char *output, uint64_t value)
+{
+    unsigned i;
+    for (i = 0; i < 8; i++)
+        output[i] = (uint8_t)((value >> (56 - 8*i)) & 0xFF);
+    return output + 8;
+}
+
+static unsigned char *aptx_save_int32(unsigned char *output, int32_t value)
+{
+    output[0] = (uint8_t)(((uint32_t)value >> 24) & 0xFF);
+    output[1] = (uint8_t)(((uint32_t)value >> 16) & 0xFF);
+    output[2] = (uint8_t)(((uint32_t)value >>  8) & 0xFF);
+    output[3] = (uint8_t)(((uint32_t)value >>  0) & 0xFF);
+    return output + 4;
+}
+
+static unsigned char *aptx_save_int32_array(unsigned char *output, const int32_t *values, unsigned count)
+{
+    unsigned i;
+    for (i = 0; i < count; i++)
+        output = aptx_save_int32(output, values[i]);
+    return output;
+}
+
+static const unsigned char *aptx_load_uint64(const unsigned char *input, uint64_t *value)
+{
+    unsigned i;
+    *value = 0;
+    for (i = 0; i < 8; i++)
+        *value = (*value << 8) | input[i];
+    return input + 8;
+}
+
+static const unsigned char *aptx_load_int32(const unsigned char *input, int32_t *value)
+{
+    union { uint32_t u; int32_t s; } v;
+    v.u = ((uint32_t)input[0] << 24) |
+          ((uint32_t)input[1] << 16) |
+          ((uint32_t)input[2] <<  8) |
+          ((uint32_t)input[3] <<  0);
+    *value = v.s;
+    return input + 4;
+}
+
+static const unsigned char *aptx_load_int32_array(const unsigned char *input, int32_t *values, unsigned count)
+{
+    unsigned i;
+    for (i = 0; i < count; i++)
+        input = aptx_load_int32(input, &values[i]);
+    return input;
+}
+
+/*
+ * Serialize filter signal. Second half of buffer is just a copy of the first
+ * half, so it is not stored.
+ */
+static unsigned char *aptx_save_filter_signal(unsigned char *output, const struct aptx_filter_signal *signal)
+{
+    output = aptx_save_int32(output, signal->pos);
+    return aptx_save_int32_array(output, signal->buffer, FILTER_TAPS);
+}
+
+static const unsigned char *aptx_load_filter_signal(const unsigned char *input, struct aptx_filter_signal *signal, int *valid)
+{
+    int32_t pos;
+    unsigned i;
+
+    input = aptx_load_int32(input, &pos);
+    input = aptx_load_int32_array(input, signal->buffer, FILTER_TAPS);
+    for (i = 0; i < FILTER_TAPS; i++)
+        signal->buffer[i+FILTER_TAPS] = signal->buffer[i];
+
+    if (pos < 0 || pos >= FILTER_TAPS)
+        *valid = 0;
+    signal->pos = (uint8_t)(pos & (FILTER_TAPS - 1));
+    return input;
+}
+
+static unsigned char *aptx_save_channel(unsigned char *output, const struct aptx_channel *channel)
+{
+    const struct aptx_prediction *prediction;
+    unsigned i, j;
+
+    output = aptx_save_int32(output, channel->codeword_history);
+    output = aptx_save_int32(output, channel->dither_parity);
+    output = aptx_save_int32_array(output, channel->dither, NB_SUBBANDS);
+
+    for (i = 0; i < NB_FILTERS; i++)
+        output = aptx_save_filter_signal(output, &channel->qmf.outer_filter_signal[i]);
+    for (i = 0; i < NB_FILTERS; i++)
+        for (j = 0; j < NB_FILTERS; j++)
+            output = aptx_save_filter_signal(output, &channel->qmf.inner_filter_signal[i][j]);
+
+    for (i = 0; i < NB_SUBBANDS; i++) {
+        output = aptx_save_int32(output, channel->quantize[i].quantized_sample);
+        output = aptx_save_int32(output, channel->quantize[i].quantized_sample_parity_change);
+        output = aptx_save_int32(output, channel->quantize[i].error);
+    }
+
+    for (i = 0; i < NB_SUBBANDS; i++) {
+        output = aptx_save_int32(output, channel->invert_quantize[i].quantization_factor);
+        output = aptx_save_int32(output, channel->invert_quantize[i].factor_select);
+        output = aptx_save_int32(output, channel->invert_quantize[i].reconstructed_difference);
+    }
+
+    for (i = 0; i < NB_SUBBANDS; i++) {
+        prediction = &channel->prediction[i];
+        output = aptx_save_int32_array(output, prediction->prev_sign, ARRAY_SIZE(prediction->prev_sign));
+        output = aptx_save_int32_array(output, prediction->s_weight, ARRAY_SIZE(prediction->s_weight));
+        output = aptx_save_int32_array(output, prediction->d_weight, ARRAY_SIZE(prediction->d_weight));
+        output = aptx_save_int32(output, prediction->pos);
+        output = aptx_save_int32_array(output, prediction->reconstructed_differences, ARRAY_SIZE(prediction->reconstructed_differences));
+        output = aptx_save_int32(output, prediction->previous_reconstructed_sample);
+        output = aptx_save_int32(output, prediction->predicted_difference);
+        output = aptx_save_int32(output, prediction->predicted_sample);
+    }
+
+    return output;
+}
+
+static const unsigned char *aptx_load_channel(const unsigned char *input, struct aptx_channel *channel, int hd, int *valid)
+{
+    struct aptx_prediction *prediction;
+    unsigned i, j;
+
+    input = aptx_load_int32(input, &channel->codeword_history);
+    input = aptx_load_int32(input, &channel->dither_parity);
+    input = aptx_load_int32_array(input, channel->dither, NB_SUBBANDS);
+
+    for (i = 0; i < NB_FILTERS; i++)
+        input = aptx_load_filter_signal(input, &channel->qmf.outer_filter_signal[i], valid);
+    for (i = 0; i < NB_FILTERS; i++)
+        for (j = 0; j < NB_FILTERS; j++)
+            input = aptx_load_filter_signal(input, &channel->qmf.inner_filter_signal[i][j], valid);
+
+    for (i = 0; i < NB_SUBBANDS; i++) {
+        input = aptx_load_int32(input, &channel->quantize[i].quantized_sample);
+        input = aptx_load_int32(input, &channel->quantize[i].quantized_sample_parity_change);
+        input = aptx_load_int32(input, &channel->quantize[i].error);
+    }
+
+    for (i = 0; i < NB_SUBBANDS; i++) {
+        input = aptx_load_int32(input, &channel->invert_quantize[i].quantization_factor);
+        input = aptx_load_int32(input, &channel->invert_quantize[i].factor_select);
+        input = aptx_load_int32(input, &channel->invert_quantize[i].reconstructed_difference);
+    }
+
+    for (i = 0; i < NB_SUBBANDS; i++) {
+        prediction = &channel->prediction[i];
+        input = aptx_load_int32_array(input, prediction->prev_sign, ARRAY_SIZE(prediction->prev_sign));
+        input = aptx_load_int32_array(input, prediction->s_weight, ARRAY_SIZE(prediction->s_weight));
+        input = aptx_load_int32_array(input, prediction->d_weight, ARRAY_SIZE(prediction->d_weight));
+        input = aptx_load_int32(input, &prediction->pos);
+        input = aptx_load_int32_array(input, prediction->reconstructed_differences, ARRAY_SIZE(prediction->reconstructed_differences));
+        input = aptx_load_int32(input, &prediction->previous_reconstructed_sample);
+        input = aptx_load_int32(input, &prediction->predicted_difference);
+        input = aptx_load_int32(input, &prediction->predicted_sample);
+
+        /* Position and factor are used as array indexes, so check their range */
+        if (prediction->pos < 0 || prediction->pos >= all_tables[hd][i].prediction_order)
+            *valid = 0;
+        if (channel->invert_quantize[i].factor_select < 0 || channel->invert_quantize[i].factor_select > all_tables[hd][i].factor_max)
+            *valid = 0;
+
+        /*
+         * Remaining predictor state is used in int32_t arithmetic which cannot
+         * overflow only within the ranges the filtering and its clips keep
+         */
+        if (channel->invert_quantize[i].quantization_factor < 0 || channel->invert_quantize[i].quantization_factor > (quantization_factors[31] << 11))
+            *valid = 0;
+        for (j = 0; j < ARRAY_SIZE(prediction->prev_sign); j++)
+            if (prediction->prev_sign[j] != 1 && prediction->prev_sign[j] != -1)
+                *valid = 0;
+        if (prediction->s_weight[0] < -0x300000 || prediction->s_weight[0] > 0x300000)
+            *valid = 0;
+        else if (prediction->s_weight[1] < -(0x3C0000 - prediction->s_weight[0]) || prediction->s_weight[1] > 0x3C0000 - prediction->s_weight[0])
+            *valid = 0;
+        for (j = 0; j < ARRAY_SIZE(prediction->d_weight); j++)
+            if (prediction->d_weight[j] < -0x800000 || prediction->d_weight[j] > 0x800000)
+                *valid = 0;
+        if (prediction->previous_reconstructed_sample != clip_intp2(prediction->previous_reconstructed_sample, 23) ||
+            prediction->predicted_difference != clip_intp2(prediction->predicted_difference, 23) ||
+            prediction->predicted_sample != clip_intp2(prediction->predicted_sample, 23))
+            *valid = 0;
+    }
+
+    return input;
+}
+
+
+const int aptx_major = OPENAPTX_MAJOR;
+const int aptx_minor = OPENAPTX_MINOR;
+const int aptx_patch = OPENAPTX_PATCH;
+
+struct aptx_context *aptx_init(int hd)
+{
+    struct aptx_context *ctx;
+
+    ctx = (struct aptx_context *)malloc(sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+
+    ctx->hd = hd ? 1 : 0;
+    ctx->analysis = NULL;
+    ctx->error_tolerance = 0;
+    aptx_reset_stats(ctx);
+#ifdef OPENAPTX_PROFILE
+    aptx_reset_profile(ctx);
+#endif
+
+    aptx_reset(ctx);
+    return ctx;
+}
+
+void aptx_reset(struct aptx_context *ctx)
+{
+    const uint8_t hd = ctx->hd;
+    const struct aptx_stats stats = ctx->stats;
+    struct aptx_analysis *const analysis = ctx->analysis;
+    const uint8_t error_tolerance = ctx->error_tolerance;
+#ifdef OPENAPTX_PROFILE
+    const struct aptx_profile profile = ctx->profile;
+#endif
+    unsigned i, chan, subband;
+    struct aptx_channel *channel;
+    struct aptx_prediction *prediction;
+
+    for (i = 0; i < sizeof(*ctx); i++)
+        ((unsigned char *)ctx)[i] = 0;
+
+    ctx->hd = hd;
+    ctx->stats = stats;
+    ctx->analysis = analysis;
+    ctx->error_tolerance = error_tolerance;
+#ifdef OPENAPTX_PROFILE
+    ctx->profile = profile;
+#endif
+    ctx->decode_skip_leading = (LATENCY_SAMPLES+3)/4;
+    ctx->encode_remaining = (LATENCY_SAMPLES+3)/4;
+
+    for (chan = 0; chan < NB_CHANNELS; chan++) {
+        channel = &ctx->channels[chan];
+        for (subband = 0; subband < NB_SUBBANDS; subband++) {
+            prediction = &channel->prediction[subband];
+            prediction->prev_sign[0] = 1;
+            prediction->prev_sign[1] = 1;
+        }
+    }
+}
+
+void aptx_finish(struct aptx_context *ctx)
+{
+    free(ctx);
+}
+
+size_t aptx_encode(struct aptx_context *ctx, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    int32_t samples[QMF_BLOCK_PACKETS][NB_CHANNELS][4];
+    int32_t subband_samples[QMF_BLOCK_PACKETS][NB_CHANNELS][NB_SUBBANDS];
+    struct aptx_codewords codewords;
+    unsigned channel;
+    size_t ipos, opos, packets, n;
+
+    APTX_PROBE2(encode_entry, ctx, input_size);
+
+    for (ipos = 0, opos = 0; ipos + 3*NB_CHANNELS*4 <= input_size && opos + sample_size <= output_size; ) {
+        packets = (input_size - ipos) / (3*NB_CHANNELS*4);
+        if (packets > (output_size - opos) / sample_size)
+            packets = (output_size - opos) / sample_size;
+        if (packets > QMF_BLOCK_PACKETS)
+            packets = QMF_BLOCK_PACKETS;
+
+        for (n = 0; n < packets; n++)
+            aptx_read_samples(input + ipos + n * 3*NB_CHANNELS*4, samples[n]);
+
+        APTX_PROFILE_BEGIN(ctx);
+        aptx_qmf_stereo_analysis_block(ctx, samples, packets, subband_samples);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_QMF_ANALYSIS, packets);
+
+        /* Taking codeword fields is part of packing, its aptX samples are counted by packing of block */
+        for (n = 0; n < packets; n++) {
+            aptx_quantize_subband_samples(ctx, subband_samples[n]);
+            for (channel = 0; channel < NB_CHANNELS; channel++)
+                aptx_get_codeword_fields(&ctx->channels[channel], &codewords, channel, n);
+            APTX_PROFILE_STAGE(ctx, APTX_PROFILE_PACK, 0);
+        }
+
+        aptx_pack_codewords(ctx, &codewords, packets, output + opos);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_PACK, packets);
+
+        ipos += packets * 3*NB_CHANNELS*4;
+        opos += packets * sample_size;
+    }
+
+    APTX_PROBE3(encode_return, ctx, ipos, opos);
+
+    *written = opos;
+    return ipos;
+}
+
+size_t aptx_encode_dual(struct aptx_context *ctx, struct aptx_context *ctx2, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written, unsigned char *output2, size_t output2_size, size_t *written2)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    const size_t sample2_size = ctx2->hd ? 6 : 4;
+    int32_t samples[QMF_BLOCK_PACKETS][NB_CHANNELS][4];
+    int32_t subband_samples[QMF_BLOCK_PACKETS][NB_CHANNELS][NB_SUBBANDS];
+    struct aptx_codewords codewords, codewords2;
+    unsigned channel;
+    size_t ipos, opos, opos2, packets, n;
+
+    APTX_PROBE2(encode_entry, ctx, input_size);
+
+    for (ipos = 0, opos = 0, opos2 = 0; ipos + 3*NB_CHANNELS*4 <= input_size && opos + sample_size <= output_size && opos2 + sample2_size <= output2_size; ) {
+        packets = (input_size - ipos) / (3*NB_CHANNELS*4);
+        if (packets > (output_size - opos) / sample_size)
+            packets = (output_size - opos) / sample_size;
+        if (packets > (output2_size - opos2) / sample2_size)
+            packets = (output2_size - opos2) / sample2_size;
+        if (packets > QMF_BLOCK_PACKETS)
+            packets = QMF_BLOCK_PACKETS;
+
+        for (n = 0; n < packets; n++)
+            aptx_read_samples(input + ipos + n * 3*NB_CHANNELS*4, samples[n]);
+
+        APTX_PROFILE_BEGIN(ctx);
+        aptx_qmf_stereo_analysis_block(ctx, samples, packets, subband_samples);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_QMF_ANALYSIS, packets);
+
+        /* Each context measures only its own work, aptX samples of taking codeword fields are counted by packing of block */
+        for (n = 0; n < packets; n++) {
+            aptx_quantize_subband_samples(ctx, subband_samples[n]);
+            for (channel = 0; channel < NB_CHANNELS; channel++)
+                aptx_get_codeword_fields(&ctx->channels[channel], &codewords, channel, n);
+            APTX_PROFILE_STAGE(ctx, APTX_PROFILE_PACK, 0);
+            APTX_PROFILE_BEGIN(ctx2);
+            aptx_quantize_subband_samples(ctx2, subband_samples[n]);
+            for (channel = 0; channel < NB_CHANNELS; channel++)
+                aptx_get_codeword_fields(&ctx2->channels[channel], &codewords2, channel, n);
+            APTX_PROFILE_STAGE(ctx2, APTX_PROFILE_PACK, 0);
+            APTX_PROFILE_BEGIN(ctx);
+        }
+
+        aptx_pack_codewords(ctx, &codewords, packets, output + opos);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_PACK, packets);
+        APTX_PROFILE_BEGIN(ctx2);
+        aptx_pack_codewords(ctx2, &codewords2, packets, output2 + opos2);
+        APTX_PROFILE_STAGE(ctx2, APTX_PROFILE_PACK, packets);
+
+        ipos += packets * 3*NB_CHANNELS*4;
+        opos += packets * sample_size;
+        opos2 += packets * sample2_size;
+    }
+
+    APTX_PROBE3(encode_return, ctx, ipos, opos);
+
+    *written = opos;
+    *written2 = opos2;
+    return ipos;
+}
+
+size_t aptx_encode_subbands(struct aptx_context *ctx, const int32_t *input, size_t input_items, unsigned char *output, size_t output_size, size_t *written)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    int32_t subband_samples[NB_CHANNELS][NB_SUBBANDS];
+    unsigned subband, channel;
     size_t ipos, opos;
 
-    for (ipos = 0, opos = 0; ipos + 3*NB_CHANNELS*4 <= input_size && opos + sample_size <= output_size; opos += sample_size) {
-        for (sample = 0; sample < 4; sample++) {
-            for (channel = 0; channel < NB_CHANNELS; channel++, ipos += 3) {
-                /* samples need to contain 24bit signed integer stored as 32bit signed integers */
-                /* last int8_t --> uint32_t cast propagates signedness for 32bit integer */
-                samples[channel][sample] = (int32_t)(((uint32_t)input[ipos+0] << 0) |
-                                                     ((uint32_t)input[ipos+1] << 8) |
-                                                     ((uint32_t)(int8_t)input[ipos+2] << 16));
+    APTX_PROBE2(encode_entry, ctx, input_items);
+
+    for (ipos = 0, opos = 0; ipos + NB_CHANNELS*NB_SUBBANDS <= input_items && opos + sample_size <= output_size; opos += sample_size) {
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            for (subband = 0; subband < NB_SUBBANDS; subband++, ipos++)
+                subband_samples[channel][subband] = clip_intp2(input[ipos], 23);
+        APTX_PROFILE_BEGIN(ctx);
+        aptx_encode_subband_samples(ctx, subband_samples, output + opos);
+    }
+
+    APTX_PROBE3(encode_return, ctx, ipos, opos);
+
+    *written = opos;
+    return ipos;
+}
+
+int aptx_encode_finish(struct aptx_context *ctx, unsigned char *output, size_t output_size, size_t *written)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    int32_t samples[NB_CHANNELS][4] = { { 0 } };
+    size_t opos;
+
+    if (ctx->encode_remaining == 0) {
+        *written = 0;
+        return 1;
+    }
+
+    for (opos = 0; ctx->encode_remaining > 0 && opos + sample_size <= output_size; ctx->encode_remaining--, opos += sample_size)
+        aptx_encode_samples(ctx, samples, output + opos);
+
+    *written = opos;
+
+    if (ctx->encode_remaining > 0)
+        return 0;
+
+    aptx_reset(ctx);
+    return 1;
+}
+
+int aptx_encode_dual_finish(struct aptx_context *ctx, struct aptx_context *ctx2, unsigned char *output, size_t output_size, size_t *written, unsigned char *output2, size_t output2_size, size_t *written2)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    const size_t sample2_size = ctx2->hd ? 6 : 4;
+    int32_t samples[NB_CHANNELS][4] = { { 0 } };
+    size_t opos, opos2;
+
+    if (ctx->encode_remaining == 0 && ctx2->encode_remaining == 0) {
+        *written = 0;
+        *written2 = 0;
+        return 1;
+    }
+
+    /* Each context is flushed by its own counter, contexts which still need output advance together */
+    for (opos = 0, opos2 = 0; ctx->encode_remaining > 0 || ctx2->encode_remaining > 0; ) {
+        if (ctx->encode_remaining > 0 && opos + sample_size > output_size)
+            break;
+        if (ctx2->encode_remaining > 0 && opos2 + sample2_size > output2_size)
+            break;
+
+        aptx_encode_dual_samples(ctx, ctx2, samples, ctx->encode_remaining > 0 ? output + opos : NULL, ctx2->encode_remaining > 0 ? output2 + opos2 : NULL);
+
+        if (ctx->encode_remaining > 0) {
+            ctx->encode_remaining--;
+            opos += sample_size;
+        }
+        if (ctx2->encode_remaining > 0) {
+            ctx2->encode_remaining--;
+            opos2 += sample2_size;
+        }
+    }
+
+    *written = opos;
+    *written2 = opos2;
+
+    if (ctx->encode_remaining > 0 || ctx2->encode_remaining > 0)
+        return 0;
+
+    aptx_reset(ctx);
+    aptx_reset(ctx2);
+    return 1;
+}
+
+/*
+ * Decide whether parity check failure of the next aptX sample can be
+ * tolerated. Failures are remembered for the last 16 aptX samples and decoding
+ * fails when there are more of them than the configured tolerance. History is
+ * updated only when aptX sample is accepted, so rejected aptX sample does not
+ * change decoder state. Tolerance is not applied while aptx_decode_sync()
+ * searches for synchronization.
+ */
+static int aptx_tolerate_parity(struct aptx_context *ctx, int failed)
+{
+    unsigned failures = 0;
+    uint16_t history, pending;
+
+    if (ctx->error_tolerance == 0 || ctx->decode_dropped > 0)
+        return !failed;
+
+    history = (uint16_t)((ctx->error_history << 1) | (failed ? 1 : 0));
+    if (failed) {
+        for (pending = history; pending; pending &= (uint16_t)(pending - 1))
+            failures++;
+        if (failures > ctx->error_tolerance)
+            return 0;
+        ctx->stats.tolerated++;
+    }
+
+    ctx->error_history = history;
+    return 1;
+}
+
+/*
+ * Accumulate analysis of decoded samples which were just stored into output
+ * buffer, starting from sample first.
+ */
+static void aptx_analyze_samples(struct aptx_analysis *analysis,
+                                 const int32_t samples[NB_CHANNELS][4],
+                                 unsigned first,
+                                 const uint8_t *output)
+{
+    uint64_t hash = analysis->hash;
+    unsigned sample, channel, i;
+    int32_t value;
+    uint32_t magnitude;
+
+    for (sample = first; sample < 4; sample++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            value = samples[channel][sample];
+            magnitude = (value < 0) ? (uint32_t)-(int64_t)value : (uint32_t)value;
+            if (analysis->peak[channel] < magnitude)
+                analysis->peak[channel] = magnitude;
+            if (value >= (1 << 23) - 1 || value <= -(1 << 23))
+                analysis->clipped[channel]++;
+            analysis->sum_squares[channel] += (double)value * (double)value;
+        }
+    }
+
+    /* FNV-1a hash of output bytes */
+    for (i = 0; i < (4 - first) * 3*NB_CHANNELS; i++)
+        hash = (hash ^ output[i]) * UINT64_C(0x100000001b3);
+
+    analysis->hash = hash;
+    analysis->samples += 4 - first;
+}
+
+/*
+ * Store decoded samples of one aptX sample into output buffer, except samples
+ * skipped due to decoder latency. Returns number of stored bytes.
+ */
+static size_t aptx_output_samples(struct aptx_context *ctx,
+                                  const int32_t samples[NB_CHANNELS][4],
+                                  uint8_t *output)
+{
+    unsigned first, sample, channel;
+    size_t opos;
+
+    first = 0;
+    if (ctx->decode_skip_leading > 0) {
+        ctx->decode_skip_leading--;
+        if (ctx->decode_skip_leading > 0) {
+            ctx->stats.skipped_leading += 4;
+            return 0;
+        }
+        first = LATENCY_SAMPLES%4;
+        ctx->stats.skipped_leading += first;
+    }
+
+    for (sample = first, opos = 0; sample < 4; sample++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++, opos += 3) {
+            /* samples contain 24bit signed integers stored as 32bit signed integers */
+            /* we do not need to care about negative integers specially as they have 23th bit set */
+            output[opos+0] = (uint8_t)(((uint32_t)samples[channel][sample] >>  0) & 0xFF);
+            output[opos+1] = (uint8_t)(((uint32_t)samples[channel][sample] >>  8) & 0xFF);
+            output[opos+2] = (uint8_t)(((uint32_t)samples[channel][sample] >> 16) & 0xFF);
+        }
+    }
+
+    if (ctx->analysis)
+        aptx_analyze_samples(ctx->analysis, samples, first, output);
+
+    return opos;
+}
+
+size_t aptx_decode(struct aptx_context *ctx, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    int32_t subband_samples[QMF_BLOCK_PACKETS][NB_CHANNELS][NB_SUBBANDS];
+    int32_t samples[QMF_BLOCK_PACKETS][NB_CHANNELS][4];
+    struct aptx_codewords codewords;
+    unsigned channel, subband;
+    size_t ipos, opos, packets, n;
+    int failed = 0;
+
+    APTX_PROBE2(decode_entry, ctx, input_size);
+
+    for (ipos = 0, opos = 0; !failed && ipos + sample_size <= input_size && (opos + 3*NB_CHANNELS*4 <= output_size || ctx->decode_skip_leading > 0); ) {
+        /* Size of output varies while leading samples are skipped, so decode them one by one */
+        packets = (input_size - ipos) / sample_size;
+        if (ctx->decode_skip_leading > 0)
+            packets = 1;
+        else if (packets > (output_size - opos) / (3*NB_CHANNELS*4))
+            packets = (output_size - opos) / (3*NB_CHANNELS*4);
+        if (packets > QMF_BLOCK_PACKETS)
+            packets = QMF_BLOCK_PACKETS;
+
+        APTX_PROFILE_BEGIN(ctx);
+        aptx_unpack_codewords(ctx, input + ipos, packets, &codewords);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_UNPACK, packets);
+
+        for (n = 0; n < packets; n++) {
+            failed = aptx_packet_parity(ctx->hd, input + ipos + n * sample_size) ^ (ctx->sync_idx == 7);
+            if (!aptx_tolerate_parity(ctx, failed)) {
+                APTX_PROBE2(parity_error, ctx, (ctx->sync_idx + 1) & 7);
+                break;
             }
+            if (failed)
+                ctx->stats.parity_errors++;
+            else
+                ctx->stats.decoded++;
+            failed = 0;
+            aptx_decode_codewords(ctx, &codewords, n);
+            for (channel = 0; channel < NB_CHANNELS; channel++)
+                for (subband = 0; subband < NB_SUBBANDS; subband++)
+                    subband_samples[n][channel][subband] = ctx->channels[channel].prediction[subband].previous_reconstructed_sample;
         }
-        aptx_encode_samples(ctx, samples, output + opos);
+
+        APTX_PROFILE_BEGIN(ctx);
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            aptx_qmf_tree_synthesis_packets(&ctx->channels[channel].qmf, subband_samples, channel, n, samples);
+        APTX_PROFILE_STAGE(ctx, APTX_PROFILE_QMF_SYNTHESIS, n);
+
+        packets = n;
+        for (n = 0; n < packets; n++, ipos += sample_size)
+            opos += aptx_output_samples(ctx, samples[n], output + opos);
     }
 
+    APTX_PROBE3(decode_return, ctx, ipos, opos);
+
     *written = opos;
     return ipos;
 }
 
-int aptx_encode_finish(struct aptx_context *ctx, unsigned char *output, size_t output_size, size_t *written)
+/*
+ * Synthesize one lost aptX sample. Dither is generated from codeword of the
+ * last decoded aptX sample like by aptx_decode_packet() and then quantized
+ * samples of the lost one are taken as zero for dither history. Each subband
+ * continues by its predicted sample, which decays by 1/8 per aptX sample
+ * towards silence. Quantization factors and predictor weights are kept as
+ * they were before the loss.
+ */
+static void aptx_conceal_samples(struct aptx_context *ctx, int32_t samples[NB_CHANNELS][4])
 {
-    const size_t sample_size = ctx->hd ? 6 : 4;
-    int32_t samples[NB_CHANNELS][4] = { { 0 } };
-    size_t opos;
+    struct aptx_channel *channel;
+    struct aptx_prediction *prediction;
+    unsigned i, subband;
 
-    if (ctx->encode_remaining == 0) {
-        *written = 0;
-        return 1;
+    for (i = 0; i < NB_CHANNELS; i++) {
+        channel = &ctx->channels[i];
+        aptx_generate_dither(channel);
+        for (subband = 0; subband < NB_SUBBANDS; subband++)
+            channel->quantize[subband].quantized_sample = 0;
+        for (subband = 0; subband < NB_SUBBANDS; subband++) {
+            prediction = &channel->prediction[subband];
+            aptx_prediction_filtering(prediction,
+                                      -rshift32(prediction->predicted_sample, 3),
+                                      all_tables[ctx->hd][subband].prediction_order);
+        }
+        aptx_decode_channel(channel, samples[i]);
     }
 
-    for (opos = 0; ctx->encode_remaining > 0 && opos + sample_size <= output_size; ctx->encode_remaining--, opos += sample_size)
-        aptx_encode_samples(ctx, samples, output + opos);
+    ctx->sync_idx = (ctx->sync_idx + 1) & 7;
+}
 
-    *written = opos;
+size_t aptx_decode_conceal(struct aptx_context *ctx, size_t packets, unsigned char *output, size_t output_size, size_t *written)
+{
+    int32_t samples[NB_CHANNELS][4];
+    size_t packet, opos;
 
-    if (ctx->encode_remaining > 0)
-        return 0;
+    for (packet = 0, opos = 0; packet < packets && (opos + 3*NB_CHANNELS*4 <= output_size || ctx->decode_skip_leading > 0); packet++) {
+        aptx_conceal_samples(ctx, samples);
+        ctx->stats.concealed++;
+        opos += aptx_output_samples(ctx, samples, output + opos);
+    }
 
-    aptx_reset(ctx);
-    return 1;
+    *written = opos;
+    return packet;
 }
 
-size_t aptx_decode(struct aptx_context *ctx, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written)
+size_t aptx_decode_skip(struct aptx_context *ctx, const unsigned char *input, size_t input_size)
 {
     const size_t sample_size = ctx->hd ? 6 : 4;
+    const size_t packets = input_size / sample_size;
     int32_t samples[NB_CHANNELS][4];
-    unsigned sample, channel;
-    size_t ipos, opos;
+    unsigned channel;
+    size_t packet, skipped;
+    int ret;
+
+    APTX_PROBE2(decode_entry, ctx, input_size);
 
-    for (ipos = 0, opos = 0; ipos + sample_size <= input_size && (opos + 3*NB_CHANNELS*4 <= output_size || ctx->decode_skip_leading > 0); ipos += sample_size) {
-        if (aptx_decode_samples(ctx, input + ipos, samples))
+    skipped = 0;
+    for (packet = 0; packet < packets; packet++) {
+        if (packets - packet > QMF_SYNTHESIS_PACKETS) {
+            ret = aptx_decode_packet(ctx, input + packet * sample_size);
+            skipped++;
+        } else {
+            if (skipped > 0) {
+                for (channel = 0; channel < NB_CHANNELS; channel++)
+                    aptx_qmf_tree_skip(&ctx->channels[channel].qmf, skipped);
+                skipped = 0;
+            }
+            ret = aptx_decode_samples(ctx, input + packet * sample_size, samples);
+        }
+        if (ret)
             break;
-        sample = 0;
+        ctx->stats.decoded++;
         if (ctx->decode_skip_leading > 0) {
             ctx->decode_skip_leading--;
-            if (ctx->decode_skip_leading > 0)
-                continue;
-            sample = LATENCY_SAMPLES%4;
+            ctx->stats.skipped_leading += (ctx->decode_skip_leading > 0) ? 4 : LATENCY_SAMPLES%4;
+        }
+    }
+
+    for (channel = 0; skipped > 0 && channel < NB_CHANNELS; channel++)
+        aptx_qmf_tree_skip(&ctx->channels[channel].qmf, skipped);
+
+    APTX_PROBE3(decode_return, ctx, packet * sample_size, 0);
+
+    return packet * sample_size;
+}
+
+size_t aptx_decode_preview(struct aptx_context *ctx, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    int32_t samples[NB_CHANNELS];
+    unsigned channel;
+    size_t ipos, opos;
+
+    APTX_PROBE2(decode_entry, ctx, input_size);
+
+    for (ipos = 0, opos = 0; ipos + sample_size <= input_size && opos + 3*NB_CHANNELS <= output_size; ipos += sample_size) {
+        if (aptx_decode_preview_samples(ctx, input + ipos, samples))
+            break;
+        ctx->stats.decoded++;
+        for (channel = 0; channel < NB_CHANNELS; channel++, opos += 3) {
+            output[opos+0] = (uint8_t)(((uint32_t)samples[channel] >>  0) & 0xFF);
+            output[opos+1] = (uint8_t)(((uint32_t)samples[channel] >>  8) & 0xFF);
+            output[opos+2] = (uint8_t)(((uint32_t)samples[channel] >> 16) & 0xFF);
         }
-        for (; sample < 4; sample++) {
-            for (channel = 0; channel < NB_CHANNELS; channel++, opos += 3) {
-                /* samples contain 24bit signed integers stored as 32bit signed integers */
-                /* we do not need to care about negative integers specially as they have 23th bit set */
-                output[opos+0] = (uint8_t)(((uint32_t)samples[channel][sample] >>  0) & 0xFF);
-                output[opos+1] = (uint8_t)(((uint32_t)samples[channel][sample] >>  8) & 0xFF);
-                output[opos+2] = (uint8_t)(((uint32_t)samples[channel][sample] >> 16) & 0xFF);
+    }
+
+    APTX_PROBE3(decode_return, ctx, ipos, opos);
+
+    *written = opos;
+    return ipos;
+}
+
+size_t aptx_decode_levels(struct aptx_context *ctx, const unsigned char *input, size_t input_size, struct aptx_levels *levels)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    unsigned channel, subband;
+    int32_t factor_select;
+    size_t ipos;
+
+    APTX_PROBE2(decode_entry, ctx, input_size);
+
+    memset(levels, 0, sizeof(*levels));
+
+    for (ipos = 0; ipos + sample_size <= input_size; ipos += sample_size) {
+        if (aptx_decode_levels_samples(ctx, input + ipos))
+            break;
+        ctx->stats.decoded++;
+        levels->packets++;
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            for (subband = 0; subband < NB_SUBBANDS; subband++) {
+                factor_select = ctx->channels[channel].invert_quantize[subband].factor_select;
+                levels->factor_select_sum[channel][subband] += (unsigned long long)factor_select;
+                if (levels->factor_select_peak[channel][subband] < (unsigned)factor_select)
+                    levels->factor_select_peak[channel][subband] = (unsigned)factor_select;
             }
         }
     }
 
+    APTX_PROBE3(decode_return, ctx, ipos, 0);
+
+    return ipos;
+}
+
+size_t aptx_decode_subbands(struct aptx_context *ctx, const unsigned char *input, size_t input_size, int32_t *output, size_t output_items, size_t *written_items)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    unsigned subband, channel;
+    size_t ipos, opos;
+
+    APTX_PROBE2(decode_entry, ctx, input_size);
+
+    for (ipos = 0, opos = 0; ipos + sample_size <= input_size && opos + NB_CHANNELS*NB_SUBBANDS <= output_items; ipos += sample_size) {
+        if (aptx_decode_packet(ctx, input + ipos))
+            break;
+        ctx->stats.decoded++;
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            for (subband = 0; subband < NB_SUBBANDS; subband++, opos++)
+                output[opos] = ctx->channels[channel].prediction[subband].previous_reconstructed_sample;
+    }
+
+    APTX_PROBE3(decode_return, ctx, ipos, opos);
+
+    *written_items = opos;
+    return ipos;
+}
+
+size_t aptx_transcode(struct aptx_context *decoder, struct aptx_context *encoder, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written)
+{
+    const size_t input_sample_size = decoder->hd ? 6 : 4;
+    const size_t output_sample_size = encoder->hd ? 6 : 4;
+    int32_t subband_samples[NB_CHANNELS][NB_SUBBANDS];
+    unsigned subband, channel;
+    size_t ipos, opos;
+
+    APTX_PROBE2(decode_entry, decoder, input_size);
+
+    for (ipos = 0, opos = 0; ipos + input_sample_size <= input_size && opos + output_sample_size <= output_size; ipos += input_sample_size, opos += output_sample_size) {
+        if (aptx_decode_packet(decoder, input + ipos))
+            break;
+        decoder->stats.decoded++;
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            for (subband = 0; subband < NB_SUBBANDS; subband++)
+                subband_samples[channel][subband] = decoder->channels[channel].prediction[subband].previous_reconstructed_sample;
+        APTX_PROFILE_BEGIN(encoder);
+        aptx_encode_subband_samples(encoder, subband_samples, output + opos);
+    }
+
+    APTX_PROBE3(decode_return, decoder, ipos, opos);
+
     *written = opos;
     return ipos;
 }
 
+#define REALIGN_PACKETS 16
+
+/*
+ * Search for new alignment of stream after lost bytes, starting at the aptX
+ * sample which failed parity check. Every byte offset within one aptX sample
+ * is tried with every position of parity sync and the first one for which
+ * parity check of the following REALIGN_PACKETS aptX samples passes is used.
+ * Decoder state is kept, so decoding continues without resetting predictors.
+ * A wrong candidate passes with probability 2^-16, so a false match among all
+ * 48 candidates is very unlikely. Returns zero when no candidate matches or
+ * input buffer is too short for the lookahead, otherwise stores number of
+ * bytes to skip into offset pointer and returns non-zero.
+ */
+static int aptx_realign(struct aptx_context *ctx, const uint8_t *input, size_t input_size, size_t *offset)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    unsigned sync_idx, i;
+    size_t pos;
+
+    for (pos = 0; pos < sample_size; pos++) {
+        if (pos + REALIGN_PACKETS*sample_size > input_size)
+            return 0;
+        for (sync_idx = 0; sync_idx < 8; sync_idx++) {
+            for (i = 0; i < REALIGN_PACKETS; i++) {
+                if (aptx_packet_parity(ctx->hd, input + pos + i*sample_size) ^ (((sync_idx + i) & 7) == 7))
+                    break;
+            }
+            if (i == REALIGN_PACKETS) {
+                ctx->sync_idx = (uint8_t)sync_idx;
+                ctx->error_history = 0;
+                *offset = pos;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Same as aptx_realign() for aptX sample which failed parity check while it
+ * was split between internal cache and input buffer, its last byte is at
+ * input position ipos-1. First bytes of sample are copied from internal cache
+ * together with beginning of input buffer needed for the lookahead.
+ */
+static int aptx_realign_split(struct aptx_context *ctx, const uint8_t *input, size_t input_size, size_t ipos, size_t *offset)
+{
+    const size_t sample_size = ctx->hd ? 6 : 4;
+    uint8_t buffer[(REALIGN_PACKETS+1)*6];
+    size_t size;
+
+    size = input_size - (ipos - 1);
+    if (size > (REALIGN_PACKETS+1)*sample_size - (sample_size-1))
+        size = (REALIGN_PACKETS+1)*sample_size - (sample_size-1);
+
+    memcpy(buffer, ctx->decode_sync_buffer, sample_size-1);
+    memcpy(buffer + sample_size-1, input + ipos - 1, size);
+    return aptx_realign(ctx, buffer, sample_size-1 + size, offset);
+}
+
 size_t aptx_decode_sync(struct aptx_context *ctx, const unsigned char *input, size_t input_size, unsigned char *output, size_t output_size, size_t *written, int *synced, size_t *dropped)
 {
     const size_t sample_size = ctx->hd ? 6 : 4;
@@ -1248,13 +2773,36 @@ size_t aptx_decode_sync(struct aptx_context *ctx, const unsigned char *input, si
             ctx->decode_dropped += processed_step;
             ctx->decode_sync_packets++;
             if (ctx->decode_sync_packets >= (LATENCY_SAMPLES+3)/4) {
+                aptx_stats_sync_regained(ctx);
                 *dropped += ctx->decode_dropped;
                 ctx->decode_dropped = 0;
                 ctx->decode_sync_packets = 0;
             }
         }
 
-        if (processed_step < sample_size) {
+        if (processed_step < sample_size)
+            ctx->stats.parity_errors++;
+
+        /* Failed aptX sample starts in internal cache, so realignment searches in its copy followed by input */
+        if (processed_step < sample_size && ctx->decode_dropped == 0 && aptx_realign_split(ctx, input, input_size, ipos, &i)) {
+            APTX_PROBE2(realigned, ctx, i);
+            ctx->stats.realigned++;
+            ctx->stats.dropped += i;
+            *dropped += i;
+            *synced = 1;
+            /* New start of aptX sample is either still in internal cache or already in input buffer */
+            if (ipos + i >= sample_size) {
+                ipos = ipos + i - sample_size;
+                ctx->decode_sync_buffer_len = 0;
+            } else {
+                ctx->decode_sync_buffer_len = (uint8_t)(sample_size - ipos - i);
+                memmove(ctx->decode_sync_buffer, ctx->decode_sync_buffer + i, ctx->decode_sync_buffer_len);
+                ipos = 0;
+                while (ctx->decode_sync_buffer_len < sample_size-1)
+                    ctx->decode_sync_buffer[ctx->decode_sync_buffer_len++] = input[ipos++];
+            }
+        } else if (processed_step < sample_size) {
+            aptx_stats_sync_lost(ctx);
             aptx_reset_decode_sync(ctx);
             *synced = 0;
             ctx->decode_dropped++;
@@ -1291,13 +2839,30 @@ size_t aptx_decode_sync(struct aptx_context *ctx, const unsigned char *input, si
             ctx->decode_dropped += processed_step;
             ctx->decode_sync_packets += processed_step / sample_size;
             if (ctx->decode_sync_packets >= (LATENCY_SAMPLES+3)/4) {
+                aptx_stats_sync_regained(ctx);
                 *dropped += ctx->decode_dropped;
                 ctx->decode_dropped = 0;
                 ctx->decode_sync_packets = 0;
             }
         }
 
-        if (processed_step < input_size_step) {
+        /* Decoding stops before parity check failure or when output buffer is full */
+        if (processed_step < input_size_step && !(aptx_packet_parity(ctx->hd, input + ipos) ^ (ctx->sync_idx == 7)))
+            break;
+
+        /* Failed aptX sample is skipped by realignment or resynchronization, so count it here */
+        if (processed_step < input_size_step)
+            ctx->stats.parity_errors++;
+
+        if (processed_step < input_size_step && ctx->decode_dropped == 0 && aptx_realign(ctx, input + ipos, input_size - ipos, &i)) {
+            APTX_PROBE2(realigned, ctx, i);
+            ctx->stats.realigned++;
+            ctx->stats.dropped += i;
+            *dropped += i;
+            *synced = 1;
+            ipos += i;
+        } else if (processed_step < input_size_step) {
+            aptx_stats_sync_lost(ctx);
             aptx_reset_decode_sync(ctx);
             *synced = 0;
             ipos++;
@@ -1321,6 +2886,273 @@ size_t aptx_decode_sync(struct aptx_context *ctx, const unsigned char *input, si
 size_t aptx_decode_sync_finish(struct aptx_context *ctx)
 {
     const uint8_t dropped = ctx->decode_sync_buffer_len;
+    ctx->stats.dropped += ctx->decode_dropped + dropped;
     aptx_reset(ctx);
     return dropped;
 }
+
+int aptx_probe(const unsigned char *input, size_t input_size, int *hd, size_t *offset, unsigned *confidence)
+{
+    size_t ones[8], total[8];
+    size_t sample_size, packets, pos, i;
+    size_t failures, candidate_failures;
+    unsigned variant, sync_idx, candidate_sync_idx;
+    double rate, best_rate, second_rate, score;
+    size_t best_packets;
+
+    if (input_size < 8*6 + 5)
+        return 0;
+
+    best_rate = 2;
+    second_rate = 2;
+    best_packets = 0;
+
+    for (variant = 0; variant < 2; variant++) {
+        sample_size = variant ? 6 : 4;
+        for (pos = 0; pos < sample_size; pos++) {
+            for (i = 0; i < 8; i++) {
+                ones[i] = 0;
+                total[i] = 0;
+            }
+
+            /* Parity statistics for each position within parity sync cycle */
+            packets = (input_size - pos) / sample_size;
+            for (i = 0; i < packets; i++) {
+                ones[i & 7] += (size_t)aptx_packet_parity((int)variant, input + pos + i*sample_size);
+                total[i & 7]++;
+            }
+
+            candidate_failures = packets + 1;
+            candidate_sync_idx = 0;
+            for (sync_idx = 0; sync_idx < 8; sync_idx++) {
+                failures = 0;
+                for (i = 0; i < 8; i++)
+                    failures += (((sync_idx + i) & 7) == 7) ? total[i] - ones[i] : ones[i];
+                if (failures < candidate_failures) {
+                    candidate_failures = failures;
+                    candidate_sync_idx = sync_idx;
+                }
+            }
+
+            rate = (double)candidate_failures / (double)packets;
+            if (rate < best_rate) {
+                second_rate = best_rate;
+                best_rate = rate;
+                best_packets = packets;
+                *hd = (int)variant;
+                *offset = pos + ((8 - candidate_sync_idx) & 7) * sample_size;
+            } else if (rate < second_rate) {
+                second_rate = rate;
+            }
+        }
+    }
+
+    /* Unrelated bits fail parity check with rate 1/2 */
+    score = 200 * (second_rate - best_rate);
+    if (score > 100)
+        score = 100;
+    if (best_packets < 64)
+        score = score * (double)best_packets / 64;
+    *confidence = (unsigned)score;
+
+    return 1;
+}
+
+void aptx_set_analysis(struct aptx_context *ctx, struct aptx_analysis *analysis)
+{
+    ctx->analysis = analysis;
+    if (analysis) {
+        memset(analysis, 0, sizeof(*analysis));
+        analysis->hash = UINT64_C(0xcbf29ce484222325);
+    }
+}
+
+void aptx_set_error_tolerance(struct aptx_context *ctx, unsigned failures)
+{
+    ctx->error_tolerance = (uint8_t)(failures > 15 ? 15 : failures);
+    ctx->error_history = 0;
+}
+
+void aptx_get_stats(const struct aptx_context *ctx, struct aptx_stats *stats)
+{
+    *stats = ctx->stats;
+}
+
+void aptx_reset_stats(struct aptx_context *ctx)
+{
+    unsigned i;
+
+    ctx->stats.encoded = 0;
+    ctx->stats.decoded = 0;
+    ctx->stats.parity_errors = 0;
+    ctx->stats.tolerated = 0;
+    ctx->stats.concealed = 0;
+    ctx->stats.sync_lost = 0;
+    ctx->stats.sync_regained = 0;
+    ctx->stats.realigned = 0;
+    ctx->stats.dropped = 0;
+    ctx->stats.skipped_leading = 0;
+    for (i = 0; i < APTX_STATS_RESYNC_BUCKETS; i++)
+        ctx->stats.resync_dropped[i] = 0;
+}
+
+int aptx_get_profile(const struct aptx_context *ctx, struct aptx_profile *profile)
+{
+#ifdef OPENAPTX_PROFILE
+    *profile = ctx->profile;
+    return 1;
+#else
+    unsigned i;
+    (void)ctx;
+    for (i = 0; i < APTX_PROFILE_STAGES; i++) {
+        profile->ticks[i] = 0;
+        profile->calls[i] = 0;
+    }
+    return 0;
+#endif
+}
+
+void aptx_reset_profile(struct aptx_context *ctx)
+{
+#ifdef OPENAPTX_PROFILE
+    unsigned i;
+    for (i = 0; i < APTX_PROFILE_STAGES; i++) {
+        ctx->profile.ticks[i] = 0;
+        ctx->profile.calls[i] = 0;
+    }
+#else
+    (void)ctx;
+#endif
+}
+
+size_t aptx_context_save(const struct aptx_context *ctx, unsigned char *output, size_t output_size)
+{
+    unsigned char *pos = output;
+    struct aptx_channel right;
+    unsigned channel;
+
+    if (output_size < APTX_CONTEXT_SIZE)
+        return 0;
+
+    *pos++ = 'a';
+    *pos++ = 'p';
+    *pos++ = 't';
+    *pos++ = 'x';
+    *pos++ = APTX_CONTEXT_VERSION;
+    *pos++ = ctx->hd;
+    *pos++ = ctx->sync_idx;
+    *pos++ = ctx->encode_remaining;
+    *pos++ = ctx->decode_skip_leading;
+    *pos++ = ctx->decode_sync_buffer_len;
+    memcpy(pos, ctx->decode_sync_buffer, sizeof(ctx->decode_sync_buffer));
+    pos += sizeof(ctx->decode_sync_buffer);
+    pos = aptx_save_uint64(pos, ctx->decode_sync_packets);
+    pos = aptx_save_uint64(pos, ctx->decode_dropped);
+
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        /* QMF state of right channel is not updated while input is mono */
+        if (channel == RIGHT && ctx->encode_mono == QMF_ANALYSIS_PACKETS) {
+            right = ctx->channels[RIGHT];
+            right.qmf = ctx->channels[LEFT].qmf;
+            pos = aptx_save_channel(pos, &right);
+        } else {
+            pos = aptx_save_channel(pos, &ctx->channels[channel]);
+        }
+    }
+
+    return (size_t)(pos - output);
+}
+
+int aptx_context_load(struct aptx_context *ctx, const unsigned char *input, size_t input_size)
+{
+    struct aptx_context loaded;
+    const unsigned char *pos = input;
+    uint64_t value;
+    unsigned channel;
+    int valid = 1;
+
+    if (input_size < APTX_CONTEXT_SIZE || memcmp(pos, "aptx", 4) != 0 || pos[4] != APTX_CONTEXT_VERSION || pos[5] > 1)
+        return 0;
+    pos += 5;
+
+    loaded = *ctx;
+    loaded.hd = *pos++;
+    loaded.sync_idx = *pos++;
+    loaded.encode_remaining = *pos++;
+    loaded.decode_skip_leading = *pos++;
+    loaded.decode_sync_buffer_len = *pos++;
+    memcpy(loaded.decode_sync_buffer, pos, sizeof(loaded.decode_sync_buffer));
+    pos += sizeof(loaded.decode_sync_buffer);
+    pos = aptx_load_uint64(pos, &value);
+    loaded.decode_sync_packets = (size_t)value;
+    pos = aptx_load_uint64(pos, &value);
+    loaded.decode_dropped = (size_t)value;
+    loaded.encode_mono = 0;
+    loaded.encode_silence = 0;
+
+    if (loaded.sync_idx > 7 || loaded.encode_remaining > (LATENCY_SAMPLES+3)/4 || loaded.decode_skip_leading > (LATENCY_SAMPLES+3)/4 || loaded.decode_sync_buffer_len >= (loaded.hd ? 6 : 4))
+        return 0;
+
+    for (channel = 0; channel < NB_CHANNELS; channel++)
+        pos = aptx_load_channel(pos, &loaded.channels[channel], loaded.hd, &valid);
+
+    if (!valid)
+        return 0;
+
+    *ctx = loaded;
+    return 1;
+}
+
+struct aptx_context *aptx_context_clone(const struct aptx_context *ctx)
+{
+    struct aptx_context *clone;
+
+    clone = (struct aptx_context *)malloc(sizeof(*clone));
+    if (!clone)
+        return NULL;
+
+    *clone = *ctx;
+    clone->analysis = NULL;
+    return clone;
+}
+
+size_t aptx_seek_entry(const struct aptx_context *ctx, size_t offset, unsigned char *output, size_t output_size)
+{
+    if (output_size < APTX_SEEK_ENTRY_SIZE)
+        return 0;
+
+    aptx_save_uint64(output, offset);
+    return 8 + aptx_context_save(ctx, output + 8, output_size - 8);
+}
+
+size_t aptx_decode_seek(struct aptx_context *ctx, const unsigned char *index, size_t index_size, size_t offset, int *rejected)
+{
+    const size_t entries = index_size / APTX_SEEK_ENTRY_SIZE;
+    size_t low, high, mid;
+    uint64_t value;
+
+    /* Binary search for the last entry with offset not after requested offset */
+    low = 0;
+    high = entries;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        aptx_load_uint64(index + mid * APTX_SEEK_ENTRY_SIZE, &value);
+        if (value <= offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    /* Entry of other codec variant does not belong to the stream being decoded */
+    *rejected = 0;
+    if (low > 0) {
+        index += (low - 1) * APTX_SEEK_ENTRY_SIZE;
+        aptx_load_uint64(index, &value);
+        if (index[8+5] == ctx->hd && aptx_context_load(ctx, index + 8, APTX_SEEK_ENTRY_SIZE - 8))
+            return (size_t)value;
+        *rejected = 1;
+    }
+
+    aptx_reset(ctx);
+    return 0;
+}
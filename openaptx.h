@@ -27,6 +27,7 @@
 #define OPENAPTX_PATCH 1
 
 #include <stddef.h>
+#include <stdint.h>
 
 extern const int aptx_major;
 extern const int aptx_minor;
@@ -69,6 +70,65 @@ size_t aptx_encode(struct aptx_context *ctx,
                    size_t output_size,
                    size_t *written);
 
+/*
+ * Encode raw stereo samples from input buffer with size input_size by two
+ * contexts at once, typically one for aptX and one for aptX HD. QMF analysis
+ * is done only once by the first context ctx and its output is quantized by
+ * both contexts, so it is faster than two aptx_encode() calls. Output buffer
+ * with size output_size and written pointer belongs to ctx, output2 buffer
+ * with size output2_size and written2 pointer belongs to ctx2. Return value
+ * indicates processed length from input buffer. Encoded streams are identical
+ * to streams produced by aptx_encode() in each context. Contexts must be
+ * different and both must be used only by aptx_encode_dual() and
+ * aptx_encode_dual_finish() for the whole stream.
+ */
+size_t aptx_encode_dual(struct aptx_context *ctx,
+                        struct aptx_context *ctx2,
+                        const unsigned char *input,
+                        size_t input_size,
+                        unsigned char *output,
+                        size_t output_size,
+                        size_t *written,
+                        unsigned char *output2,
+                        size_t output2_size,
+                        size_t *written2);
+
+/*
+ * Finish encoding of current stream by aptx_encode_dual() into both output
+ * buffers. Behaves like aptx_encode_finish(), it returns zero when any output
+ * buffer is too small and subsequent calls continue filling buffers. Each
+ * context is flushed by its own count of remaining samples, which may differ
+ * when state of context was loaded by aptx_context_load(). On success both
+ * contexts are reset and non-zero value is returned.
+ */
+int aptx_encode_dual_finish(struct aptx_context *ctx,
+                            struct aptx_context *ctx2,
+                            unsigned char *output,
+                            size_t output_size,
+                            size_t *written,
+                            unsigned char *output2,
+                            size_t output2_size,
+                            size_t *written2);
+
+/*
+ * Subband domain variant of aptx_encode() which bypasses QMF analysis. Input
+ * buffer with input_items items contains for each aptX sample 8 subband samples
+ * in order: left channel subbands 0, 1, 2, 3 and right channel subbands 0, 1, 2,
+ * 3 (subband 0 is the lowest frequency band 0 Hz to 5.5 kHz, each subband has
+ * sample rate 11025 Hz). Values are 24bit signed integers, out of range values
+ * are clipped. Return value indicates number of processed items from input
+ * buffer and to written pointer is stored length of encoded aptX audio samples
+ * in output buffer. Stream encoded from subband samples has no latency of QMF
+ * analysis, so it is not needed to call aptx_encode_finish() at the end of
+ * stream, just aptx_reset() for processing a new stream.
+ */
+size_t aptx_encode_subbands(struct aptx_context *ctx,
+                            const int32_t *input,
+                            size_t input_items,
+                            unsigned char *output,
+                            size_t output_size,
+                            size_t *written);
+
 /*
  * Finish encoding of current stream and reset internal state to be ready for
  * encoding or decoding a new stream. Due to aptX latency, last 90 samples
@@ -93,7 +153,8 @@ int aptx_encode_finish(struct aptx_context *ctx,
  * sequence of 24 bytes in format LLLRRRLLLRRRLLLRRRLLLRRR (L-left, R-right)
  * for one aptX sample. Due to aptX latency, output buffer starts filling
  * after 90 samples. When parity check fails then this function stops decoding
- * and returns processed length of input buffer. To detect such failure it is
+ * before the failed aptX sample, without changing decoder state by it, and
+ * returns processed length of input buffer. To detect such failure it is
  * needed to compare return value and input_size. Note that if you have a
  * finite stream then the last two decoded samples from the last decode call
  * does not contain any meaningful value. They are present just because aptX
@@ -107,6 +168,135 @@ size_t aptx_decode(struct aptx_context *ctx,
                    size_t output_size,
                    size_t *written);
 
+/*
+ * Conceal known loss of given number of aptX samples (packets), e.g. detected
+ * by gap in RTP sequence numbers. For each lost aptX sample decoder produces
+ * output samples extrapolated by predictor with decay towards silence and
+ * advances parity sync and dither state, so the next received aptX sample is
+ * decoded without parity check failure and without any synchronization. Into
+ * output buffer with size output_size are stored decoded samples in same
+ * format as by aptx_decode() and to written pointer is stored their length.
+ * Return value is number of concealed aptX samples, which is smaller than
+ * packets only when output buffer is too small. Function can be used with
+ * aptx_decode() or with aptx_decode_sync() when it has no cached bytes, i.e.
+ * when whole aptX samples are passed to it.
+ */
+size_t aptx_decode_conceal(struct aptx_context *ctx,
+                           size_t packets,
+                           unsigned char *output,
+                           size_t output_size,
+                           size_t *written);
+
+/*
+ * Advance decoder over aptX audio samples in input buffer with size input_size
+ * without producing decoded output samples. State of context after this call
+ * is exactly same as after aptx_decode() of the same input with thrown away
+ * output, but it is much faster as QMF synthesis is done only for the last 24
+ * aptX samples of input buffer (state of QMF synthesis does not depend on older
+ * samples). Therefore input buffer should be as large as possible. This is
+ * suitable for seeking in stream without seek index. Return value indicates
+ * processed length from input buffer, like for aptx_decode() it stops on
+ * parity check failure. After failure state of context is not fully defined.
+ */
+size_t aptx_decode_skip(struct aptx_context *ctx,
+                        const unsigned char *input,
+                        size_t input_size);
+
+/*
+ * Preview variant of aptx_decode() which decodes only the lowest subband (0 Hz
+ * to 5.5 kHz) of aptX audio samples from input buffer with size input_size,
+ * suitable for waveform thumbnails, loudness scans or scrubbing. For each aptX
+ * sample it stores only one raw 24bit signed stereo sample (6 bytes LLLRRR)
+ * into output buffer with size output_size, so output has sample rate 11025 Hz
+ * and approximately same level as full decoded output. Decoder latency is not
+ * skipped. Return value and written pointer have same meaning as for
+ * aptx_decode() and decoding stops on parity check failure. As state of other
+ * subbands is not updated, context has to be reset by aptx_reset() before it
+ * can be used for full decoding again.
+ */
+size_t aptx_decode_preview(struct aptx_context *ctx,
+                           const unsigned char *input,
+                           size_t input_size,
+                           unsigned char *output,
+                           size_t output_size,
+                           size_t *written);
+
+/*
+ * Levels of subbands measured by aptx_decode_levels() for one block of input.
+ * Arrays are indexed by [channel][subband], channel 0 is left and 1 is right,
+ * subbands are ordered from the lowest frequency (0 Hz to 5.5 kHz, 5.5 kHz to
+ * 11 kHz, 11 kHz to 16.5 kHz, 16.5 kHz to 22 kHz).
+ * packets            number of aptX samples in block
+ * factor_select_sum  sum of factor_select values (envelope of subband) over
+ *                    block, divide it by packets to get average value
+ * factor_select_peak maximal factor_select value in block
+ * Value factor_select is logarithm of quantization step of subband, 256 means
+ * twice larger step, which is in practice approximately 40 per one dB of
+ * signal level. Zero means that subband is quiet (below approximately -100 dB
+ * in the lowest subband) and full scale sine wave in the lowest subband gives
+ * value about 3370.
+ */
+struct aptx_levels {
+    unsigned long long packets;
+    unsigned long long factor_select_sum[2][4];
+    unsigned factor_select_peak[2][4];
+};
+
+/*
+ * Measure levels of subbands of aptX audio samples in input buffer with size
+ * input_size without decoding them, suitable for metering, silence detection
+ * or trimming. It updates only quantization factors of subbands, therefore it
+ * is much faster than decoding. Levels for whole input block are stored into
+ * levels pointer. Return value indicates processed length from input buffer,
+ * like for aptx_decode() it stops on parity check failure. As prediction state
+ * is not updated, context has to be reset by aptx_reset() before it can be used
+ * for decoding again.
+ */
+size_t aptx_decode_levels(struct aptx_context *ctx,
+                          const unsigned char *input,
+                          size_t input_size,
+                          struct aptx_levels *levels);
+
+/*
+ * Subband domain variant of aptx_decode() which bypasses QMF synthesis and
+ * stores reconstructed subband samples into output buffer with output_items
+ * items, 8 items for each aptX sample in same order as for input buffer of
+ * aptx_encode_subbands(). Subband samples are not delayed by decoder latency,
+ * every decoded aptX sample produces output. Return value indicates processed
+ * length from input buffer and to written_items pointer is stored number of
+ * items stored into output buffer. Decoding stops on parity check failure.
+ * As QMF synthesis state is not updated, this function should not be mixed
+ * with aptx_decode() in one stream.
+ */
+size_t aptx_decode_subbands(struct aptx_context *ctx,
+                            const unsigned char *input,
+                            size_t input_size,
+                            int32_t *output,
+                            size_t output_items,
+                            size_t *written_items);
+
+/*
+ * Transcode aptX audio samples from input buffer with size input_size decoded
+ * by decoder context into aptX audio samples encoded by encoder context into
+ * output buffer with size output_size, e.g. from aptX to aptX HD or vice versa
+ * when contexts were initialized with different hd parameter. Transcoding is
+ * done in subband domain, decoded subband samples are directly quantized by
+ * encoder, so there is no QMF synthesis nor QMF analysis and the transcoded
+ * stream has same timing as input stream without any additional latency.
+ * Return value indicates processed length from input buffer and to written
+ * pointer is stored length of encoded aptX audio samples in output buffer.
+ * Like aptx_decode() it stops on parity check failure of input. Decoder and
+ * encoder must be different contexts. At the end of stream it is not needed
+ * to call aptx_encode_finish(), just aptx_reset() on both contexts.
+ */
+size_t aptx_transcode(struct aptx_context *decoder,
+                      struct aptx_context *encoder,
+                      const unsigned char *input,
+                      size_t input_size,
+                      unsigned char *output,
+                      size_t output_size,
+                      size_t *written);
+
 /*
  * Auto synchronization variant of aptx_decode() function suitable for partially
  * corrupted continuous stream in which some bytes are missing. All arguments,
@@ -115,8 +305,14 @@ size_t aptx_decode(struct aptx_context *ctx,
  * output buffer must have space for decoding whole input buffer plus space for
  * one additional decoded sample (24 bytes) and the last difference is that this
  * function continue to decode even when parity check fails. When decoding fails
- * this function starts searching for next bytes from the input buffer which
- * have valid parity check (to be synchronized) and then starts decoding again.
+ * this function first tries to realign the stream after lost bytes: every byte
+ * offset within one aptX sample and every position of parity sync is checked
+ * on the next 16 aptX samples and when parity check of all of them passes,
+ * decoding continues from there with kept decoder state, so without any gap
+ * in output. Only when no alignment matches (or input buffer does not contain
+ * enough bytes for the check) this function resets decoder and starts
+ * searching for next bytes from the input buffer which have valid parity
+ * check (to be synchronized) and then starts decoding again.
  * Into synced pointer is stored 1 if at the end of processing is decoder fully
  * synchronized (in non-error state, with valid parity check) or is stored 0 if
  * decoder is unsynchronized (in error state, without valid parity check). Into
@@ -133,6 +329,21 @@ size_t aptx_decode_sync(struct aptx_context *ctx,
                         int *synced,
                         size_t *dropped);
 
+/*
+ * Set error tolerance mode of decoder suitable for streams with flipped bits
+ * but without lost bytes. When failures is non-zero, aptx_decode() and
+ * aptx_decode_sync() do not stop on parity check failure, but keep predictor
+ * state and alignment and pass decoded aptX sample through as it is, unless
+ * there were more than failures parity check failures in the last 16 aptX
+ * samples. Only then decoding fails like without tolerance and aptx_decode_sync()
+ * starts searching for synchronization (during which tolerance is not
+ * applied). As parity check of misaligned stream fails for about every second
+ * aptX sample, small values (e.g. 2 or 3) detect lost bytes quickly. Maximal
+ * value is 15, zero (default) disables tolerance. Setting is not changed by
+ * aptx_reset() and is not part of serialized state of context.
+ */
+void aptx_set_error_tolerance(struct aptx_context *ctx, unsigned failures);
+
 /*
  * Finish decoding of current auto synchronization stream and reset internal
  * state to be ready for encoding or decoding a new stream. This function
@@ -142,4 +353,229 @@ size_t aptx_decode_sync(struct aptx_context *ctx,
  */
 size_t aptx_decode_sync_finish(struct aptx_context *ctx);
 
+/*
+ * Probe unknown aptX or aptX HD audio stream in input buffer with size
+ * input_size, which does not have to start at the beginning of the stream nor
+ * at the boundary of aptX sample, e.g. capture from the middle of a stream.
+ * Probing uses only statistics of transmitted parity bits, every variant, byte
+ * alignment and position of parity sync is checked without decoding. Into hd
+ * pointer is stored 1 for aptX HD or 0 for aptX stream, into offset pointer is
+ * stored position of the first aptX sample in input buffer at which parity
+ * sync starts, so aptx_decode() of new context initialized with the stored hd
+ * value decodes input buffer from that offset without parity check failure.
+ * Into confidence pointer is stored value from 0 to 100. It is 100 when parity
+ * check of the best alignment passes for all aptX samples (at least 64 are
+ * needed) and all other alignments fail for about every second aptX sample,
+ * as expected for unrelated bits. It decreases with bit errors in the stream,
+ * with number of passing checks of other alignments (e.g. for digital silence
+ * which encodes to repeated bytes) and with shorter input buffer. Returns zero
+ * when input buffer is too short to contain 8 aptX HD samples at every byte
+ * alignment (53 bytes), otherwise returns non-zero value.
+ */
+int aptx_probe(const unsigned char *input,
+               size_t input_size,
+               int *hd,
+               size_t *offset,
+               unsigned *confidence);
+
+/*
+ * Analysis of decoded output samples accumulated by aptx_decode() and
+ * aptx_decode_sync(). Arrays are indexed by channel, 0 is left and 1 is right.
+ * samples     number of decoded stereo samples
+ * peak        maximal absolute value of sample
+ * clipped     number of samples with full scale value (-8388608 or 8388607)
+ * sum_squares sum of squares of samples, RMS is sqrt(sum_squares / samples)
+ * hash        64 bit FNV-1a hash of all decoded output bytes
+ */
+struct aptx_analysis {
+    unsigned long long samples;
+    unsigned long peak[2];
+    unsigned long long clipped[2];
+    double sum_squares[2];
+    unsigned long long hash;
+};
+
+/*
+ * Set analysis structure into which decoder accumulates analysis of decoded
+ * samples directly while storing them into output buffer, so no other pass
+ * over decoded output is needed. Structure is cleared by this function and
+ * it has to be valid until analysis is disabled by passing NULL pointer. It
+ * is not cleared by aptx_reset() nor by finish functions and is not copied
+ * into context created by aptx_context_clone(). Note that analysis covers all
+ * samples stored into output buffer, including last two padding samples.
+ */
+void aptx_set_analysis(struct aptx_context *ctx, struct aptx_analysis *analysis);
+
+#define APTX_STATS_RESYNC_BUCKETS 16
+
+/*
+ * Cumulative statistics of context. Counters are not cleared by aptx_reset()
+ * nor by finish functions, so they cover all streams processed by context.
+ * encoded         number of encoded aptX samples (each from 4 stereo samples)
+ * decoded         number of decoded aptX samples with valid parity check
+ * parity_errors   number of parity check failures of processed input, i.e.
+ *                 failures passed through by error tolerance mode and
+ *                 failures skipped by aptx_decode_sync(), including those
+ *                 which happened while it searched for sync, decoding
+ *                 functions which stop before failed aptX sample do not
+ *                 count it as the same input can be passed again
+ * tolerated       number of parity check failures passed through by error
+ *                 tolerance mode, see aptx_set_error_tolerance(), these aptX
+ *                 samples are decoded but not counted by decoded
+ * concealed       number of aptX samples synthesized by aptx_decode_conceal()
+ * sync_lost       number of times when aptx_decode_sync() lost synchronization
+ * sync_regained   number of times when aptx_decode_sync() regained it
+ * realigned       number of times when aptx_decode_sync() realigned stream
+ *                 after lost bytes without losing synchronization
+ * dropped         total number of dropped (not decoded) input bytes
+ * skipped_leading number of stereo samples skipped due to decoder latency
+ * resync_dropped  histogram of bytes dropped to regain synchronization, item
+ *                 at index i counts resynchronizations which dropped from 2^i
+ *                 to 2^(i+1)-1 bytes, the last item counts all larger values
+ */
+struct aptx_stats {
+    unsigned long long encoded;
+    unsigned long long decoded;
+    unsigned long long parity_errors;
+    unsigned long long tolerated;
+    unsigned long long concealed;
+    unsigned long long sync_lost;
+    unsigned long long sync_regained;
+    unsigned long long realigned;
+    unsigned long long dropped;
+    unsigned long long skipped_leading;
+    unsigned long long resync_dropped[APTX_STATS_RESYNC_BUCKETS];
+};
+
+/*
+ * Store cumulative statistics of context into stats pointer.
+ */
+void aptx_get_stats(const struct aptx_context *ctx, struct aptx_stats *stats);
+
+/*
+ * Clear cumulative statistics of context.
+ */
+void aptx_reset_stats(struct aptx_context *ctx);
+
+/*
+ * Encoder and decoder stages measured by the profiling build of library.
+ */
+enum aptx_profile_stage {
+    APTX_PROFILE_QMF_ANALYSIS,
+    APTX_PROFILE_DITHER,
+    APTX_PROFILE_QUANTIZE,
+    APTX_PROFILE_INSERT_SYNC,
+    APTX_PROFILE_INVERT_QUANTIZE,
+    APTX_PROFILE_PACK,
+    APTX_PROFILE_UNPACK,
+    APTX_PROFILE_CHECK_PARITY,
+    APTX_PROFILE_QMF_SYNTHESIS,
+    APTX_PROFILE_STAGES
+};
+
+/*
+ * Accumulated time spent in each stage and number of aptX samples processed by
+ * each stage. Stages which run per channel or per block of aptX samples count
+ * all their aptX samples too, so ticks divided by calls is cost of the stage
+ * per aptX sample and can be compared across stages. On x86 time is in CPU
+ * timestamp counter ticks, elsewhere in nanoseconds.
+ */
+struct aptx_profile {
+    unsigned long long ticks[APTX_PROFILE_STAGES];
+    unsigned long long calls[APTX_PROFILE_STAGES];
+};
+
+/*
+ * Store accumulated stage profile of context into profile pointer. Profiling
+ * is available only when library was compiled with OPENAPTX_PROFILE macro
+ * defined, otherwise profile is filled with zeros and this function returns
+ * zero. Function returns non-zero value when profile is available. Profile
+ * is accumulated across aptx_reset() calls and reading it does not clear it.
+ */
+int aptx_get_profile(const struct aptx_context *ctx, struct aptx_profile *profile);
+
+/*
+ * Clear accumulated stage profile of context.
+ */
+void aptx_reset_profile(struct aptx_context *ctx);
+
+/*
+ * Size of serialized state of aptX context produced by aptx_context_save().
+ */
+#define APTX_CONTEXT_SIZE 3648
+
+/*
+ * Serialize complete internal state of aptX context (QMF filters, quantizer,
+ * predictor, dither, parity sync and cached bytes of aptx_decode_sync()) into
+ * output buffer with size output_size. Serialized state has fixed size of
+ * APTX_CONTEXT_SIZE bytes, it is versioned and does not depend on endianity or
+ * word size of the CPU, so it can be stored or transferred to other process or
+ * machine. Statistics and profile of context are not part of serialized state.
+ * Return value is number of bytes stored into output buffer or zero when
+ * output buffer is too small.
+ */
+size_t aptx_context_save(const struct aptx_context *ctx,
+                         unsigned char *output,
+                         size_t output_size);
+
+/*
+ * Restore internal state of aptX context from input buffer with size input_size
+ * previously filled by aptx_context_save(). Context is switched to the codec
+ * variant (aptX or aptX HD) of serialized state. Subsequent encoding or decoding
+ * continues exactly as it would continue in the original context. When input
+ * buffer does not contain valid serialized state, this function returns zero
+ * and context is not changed. On success non-zero value is returned.
+ */
+int aptx_context_load(struct aptx_context *ctx,
+                      const unsigned char *input,
+                      size_t input_size);
+
+/*
+ * Allocate new aptX context with copy of the whole state of existing context,
+ * including statistics. Returned context is independent of the original one
+ * and has to be freed by aptx_finish(). On allocation failure returns NULL.
+ */
+struct aptx_context *aptx_context_clone(const struct aptx_context *ctx);
+
+/*
+ * Size of one entry of seek index produced by aptx_seek_entry().
+ */
+#define APTX_SEEK_ENTRY_SIZE (8 + APTX_CONTEXT_SIZE)
+
+/*
+ * Store one seek index entry into output buffer with size output_size. Entry
+ * consists of offset (as 64 bit big endian number) followed by serialized state
+ * of context from aptx_context_save(). Offset must be number of input bytes
+ * processed by aptx_decode() from the start of stream to the current state of
+ * decoder context. Seek index is just a sequence of such entries with
+ * increasing offsets, e.g. taken every few seconds while decoding the whole
+ * stream, and can be stored as sidecar file of stream. Return value is number
+ * of stored bytes (APTX_SEEK_ENTRY_SIZE) or zero when output buffer is too small.
+ */
+size_t aptx_seek_entry(const struct aptx_context *ctx,
+                       size_t offset,
+                       unsigned char *output,
+                       size_t output_size);
+
+/*
+ * Restore state of decoder context from seek index with size index_size for
+ * the nearest entry at or before requested input offset and return offset of
+ * that entry. Context has to be initialized for the codec variant of indexed
+ * stream, entry of other variant is invalid. When there is no such entry or
+ * the entry is invalid, context is reset and zero (start of stream) is
+ * returned. Into rejected is stored 1 when the entry exists but is invalid
+ * (e.g. index of other stream or damaged index), otherwise 0. To finish seeking, caller has to decode input bytes from returned
+ * offset up to requested offset and throw away decoded samples. After that,
+ * decoding continues with exactly same output as if the whole stream had been
+ * decoded from the start. Requested offset should be multiple of aptX sample
+ * size (4 bytes for aptX, 6 bytes for aptX HD) and decoded output at such
+ * offset corresponds to samples starting 90 samples (decoder latency) before
+ * 4 * offset / sample size.
+ */
+size_t aptx_decode_seek(struct aptx_context *ctx,
+                        const unsigned char *index,
+                        size_t index_size,
+                        size_t offset,
+                        int *rejected);
+
 #endif
@@ -0,0 +1,990 @@
+/*
+ * aptX codec stage microbenchmark
+ * Copyright (C) 2018-2021  Pali Rohár <pali.rohar@gmail.com>
+ *
+ * Read README file for license details.  Due to license abuse
+ * this program must not be used in any Freedesktop project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmark needs access to static codec stages, so include library source directly */
+#include "openaptx.c"
+
+#define BENCH_MAX_PACKETS 65536
+#define BENCH_MAX_REPEAT 100000
+#define BENCH_MAX_STREAMS 4096
+#define BENCH_STREAM_CHUNK 16
+
+/*
+ * Intermediate values of every codec stage captured from real encoding of a
+ * synthetic signal. Each stage is then timed in isolation on these values.
+ */
+struct bench_data {
+    size_t packets;
+    int hd;
+    int32_t (*pcm)[NB_CHANNELS][4];
+    uint8_t *input;
+    int32_t (*subband_samples)[NB_CHANNELS][NB_SUBBANDS];
+    int32_t (*difference)[NB_CHANNELS][NB_SUBBANDS];
+    int32_t (*dither)[NB_CHANNELS][NB_SUBBANDS];
+    int32_t (*dither_parity)[NB_CHANNELS];
+    int32_t (*quantization_factor)[NB_CHANNELS][NB_SUBBANDS];
+    struct aptx_quantize (*quantize)[NB_CHANNELS][NB_SUBBANDS];
+    struct aptx_quantize (*quantize_synced)[NB_CHANNELS][NB_SUBBANDS];
+    uint32_t (*codeword)[NB_CHANNELS];
+    uint8_t *stream;
+    int32_t (*reconstructed)[NB_CHANNELS][NB_SUBBANDS];
+};
+
+/*
+ * Outer QMF filters of both trees process two consecutive samples per aptX
+ * sample, so both outputs of each outer filter are computed together by a
+ * 2-parallel fast FIR filter. With taps split into even e[t] and odd o[t]
+ * ones and signal into pairs P[t], Q[t], every pair contributes to the two
+ * outputs by a 2x2 Toeplitz product which needs 3 instead of 4 multiplies:
+ *   y0 += e[t]*(P[t]+Q[t]) + (o[t]-e[t])*Q[t]
+ *   y1 += e[t]*(P[t]+Q[t]) + (o[t-1]-e[t])*P[t]
+ * Together with the last tap of y1 it is 25 instead of 32 multiplies. All
+ * arithmetic is on integers, so results are same as by direct convolution.
+ * Note that mirrored coefficient sets of two polyphase filters do not share
+ * any product, as each filter convolves a different signal. Pre-additions and
+ * strided access are vectorized by compiler worse than direct convolution of
+ * library, so this kernel exists only in benchmark for evaluating targets
+ * with expensive multiplies.
+ */
+struct aptx_qmf_fast_fir_coeffs {
+    int32_t even[FILTER_TAPS/2];
+    int32_t odd_diff[FILTER_TAPS/2];
+    int32_t prev_odd_diff[FILTER_TAPS/2];
+    int32_t last;
+};
+
+static const struct aptx_qmf_fast_fir_coeffs aptx_qmf_outer_fast_fir_coeffs[NB_FILTERS] = {
+    {
+        { 730, -9611, -121026, -585547, 697128, 27611, -10043, 688 },
+        { -1143, 53237, 390999, 3387513, -857609, -19133, 13554, -1585 },
+        { -730, 9198, 164652, 855520, 2104838, -188092, 18521, 2823 },
+        -897,
+    },
+    {
+        { -897, 3511, 8478, -160481, 2801966, 269973, 43626, -413 },
+        { 1585, -13554, 19133, 857609, -3387513, -390999, -53237, 1143 },
+        { 897, -2823, -18521, 188092, -2104838, -855520, -164652, -9198 },
+        730,
+    },
+};
+
+/*
+ * Compute the convolutions of the signal with the coefficients, the current
+ * one and the one after pushing next sample into signal, and reduce them to
+ * 24 bits by applying the specified right shifting.
+ */
+static inline void aptx_qmf_convolution_pair(const struct aptx_filter_signal *signal,
+                                             const struct aptx_qmf_fast_fir_coeffs *coeffs,
+                                             int32_t next,
+                                             unsigned shift,
+                                             int32_t output[2])
+{
+    const int32_t *sig = &signal->buffer[signal->pos];
+    int64_t e0 = 0, e1 = 0, common;
+    unsigned t;
+
+    for (t = 0; t < FILTER_TAPS/2; t++) {
+        common = (int64_t)(sig[2*t] + sig[2*t+1]) * (int64_t)coeffs->even[t];
+        e0 += common + (int64_t)sig[2*t+1] * (int64_t)coeffs->odd_diff[t];
+        e1 += common + (int64_t)sig[2*t] * (int64_t)coeffs->prev_odd_diff[t];
+    }
+    e1 += (int64_t)next * (int64_t)coeffs->last;
+
+    output[0] = rshift64_clip24(e0, shift);
+    output[1] = rshift64_clip24(e1, shift);
+}
+
+/*
+ * Two stage QMF analysis tree with outer filters realized by fast FIR.
+ */
+static inline void aptx_qmf_tree_analysis_fast_fir(struct aptx_QMF_analysis *qmf,
+                                                   const int32_t samples[4],
+                                                   int32_t subband_samples[NB_SUBBANDS])
+{
+    int32_t intermediate_samples[4];
+    int32_t subbands[NB_FILTERS][2];
+    unsigned i;
+
+    /* Outer filter i gets samples 1-i and 3-i of both pairs */
+    for (i = 0; i < NB_FILTERS; i++) {
+        aptx_qmf_filter_signal_push(&qmf->outer_filter_signal[i], samples[NB_FILTERS-1-i]);
+        aptx_qmf_convolution_pair(&qmf->outer_filter_signal[i], &aptx_qmf_outer_fast_fir_coeffs[i],
+                                  samples[2+NB_FILTERS-1-i], 23, subbands[i]);
+        aptx_qmf_filter_signal_push(&qmf->outer_filter_signal[i], samples[2+NB_FILTERS-1-i]);
+    }
+
+    for (i = 0; i < 2; i++) {
+        intermediate_samples[0+i] = clip_intp2(subbands[0][i] + subbands[1][i], 23);
+        intermediate_samples[2+i] = clip_intp2(subbands[0][i] - subbands[1][i], 23);
+    }
+
+    for (i = 0; i < 2; i++)
+        aptx_qmf_polyphase_analysis(qmf->inner_filter_signal[i],
+                                    aptx_qmf_inner_coeffs, 23,
+                                    &intermediate_samples[2*i],
+                                    &subband_samples[2*i+0],
+                                    &subband_samples[2*i+1]);
+}
+
+/*
+ * Two stage QMF synthesis tree with outer filters realized by fast FIR.
+ */
+static inline void aptx_qmf_tree_synthesis_fast_fir(struct aptx_QMF_analysis *qmf,
+                                                    const int32_t subband_samples[NB_SUBBANDS],
+                                                    int32_t samples[4])
+{
+    int32_t intermediate_samples[4];
+    int32_t subbands[NB_FILTERS][2];
+    int32_t output[2];
+    unsigned i;
+
+    for (i = 0; i < 2; i++)
+        aptx_qmf_polyphase_synthesis(qmf->inner_filter_signal[i],
+                                     aptx_qmf_inner_coeffs, 22,
+                                     subband_samples[2*i+0],
+                                     subband_samples[2*i+1],
+                                     &intermediate_samples[2*i]);
+
+    for (i = 0; i < 2; i++) {
+        subbands[0][i] = intermediate_samples[0+i] + intermediate_samples[2+i];
+        subbands[1][i] = intermediate_samples[0+i] - intermediate_samples[2+i];
+    }
+
+    /* Outer filter i produces samples i and 2+i */
+    for (i = 0; i < NB_FILTERS; i++) {
+        aptx_qmf_filter_signal_push(&qmf->outer_filter_signal[i], subbands[1-i][0]);
+        aptx_qmf_convolution_pair(&qmf->outer_filter_signal[i], &aptx_qmf_outer_fast_fir_coeffs[i],
+                                  subbands[1-i][1], 21, output);
+        aptx_qmf_filter_signal_push(&qmf->outer_filter_signal[i], subbands[1-i][1]);
+        samples[0+i] = output[0];
+        samples[2+i] = output[1];
+    }
+}
+
+/*
+ * Set of stage implementations. Alternative (e.g. SIMD) implementations of
+ * codec stages are added as new entries of bench_kernels[] table and are
+ * reported side by side with the generic implementation. Stage which is not
+ * provided by kernel (NULL) is not measured for that kernel.
+ */
+struct bench_kernel {
+    const char *name;
+    void (*qmf_tree_analysis)(struct aptx_QMF_analysis *qmf,
+                              const int32_t samples[4],
+                              int32_t subband_samples[NB_SUBBANDS]);
+    void (*qmf_tree_synthesis)(struct aptx_QMF_analysis *qmf,
+                               const int32_t subband_samples[NB_SUBBANDS],
+                               int32_t samples[4]);
+    void (*quantize_difference)(struct aptx_quantize *quantize,
+                                int32_t sample_difference,
+                                int32_t dither,
+                                int32_t quantization_factor,
+                                const struct aptx_tables *tables);
+    void (*process_subband)(struct aptx_invert_quantize *invert_quantize,
+                            struct aptx_prediction *prediction,
+                            int32_t quantized_sample, int32_t dither,
+                            const struct aptx_tables *tables);
+    void (*insert_sync)(struct aptx_channel channels[NB_CHANNELS], uint8_t *sync_idx);
+    uint16_t (*pack_codeword)(const struct aptx_channel *channel);
+    uint32_t (*hd_pack_codeword)(const struct aptx_channel *channel);
+    void (*unpack_codeword)(struct aptx_channel *channel, uint16_t codeword);
+    void (*hd_unpack_codeword)(struct aptx_channel *channel, uint32_t codeword);
+    void (*qmf_tree_analysis_block)(struct aptx_QMF_analysis *qmf,
+                                    const int32_t samples[][NB_CHANNELS][4],
+                                    unsigned channel,
+                                    size_t packets,
+                                    int32_t subband_samples[][NB_CHANNELS][NB_SUBBANDS]);
+    void (*qmf_tree_synthesis_block)(struct aptx_QMF_analysis *qmf,
+                                     const int32_t subband_samples[][NB_CHANNELS][NB_SUBBANDS],
+                                     unsigned channel,
+                                     size_t packets,
+                                     int32_t samples[][NB_CHANNELS][4]);
+    void (*pack_codewords)(const struct aptx_context *ctx,
+                           const struct aptx_codewords *codewords,
+                           size_t packets,
+                           uint8_t *output);
+    void (*unpack_codewords)(const struct aptx_context *ctx,
+                             const uint8_t *input,
+                             size_t packets,
+                             struct aptx_codewords *codewords);
+};
+
+static const struct bench_kernel bench_kernels[] = {
+    {
+        "generic",
+        aptx_qmf_tree_analysis,
+        aptx_qmf_tree_synthesis,
+        aptx_quantize_difference,
+        aptx_process_subband,
+        aptx_insert_sync,
+        aptx_pack_codeword,
+        aptxhd_pack_codeword,
+        aptx_unpack_codeword,
+        aptxhd_unpack_codeword,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+    },
+    {
+        "fast_fir",
+        aptx_qmf_tree_analysis_fast_fir,
+        aptx_qmf_tree_synthesis_fast_fir,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+    },
+    {
+        "block",
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        aptx_qmf_tree_analysis_block,
+        aptx_qmf_tree_synthesis_block,
+        aptx_pack_codewords,
+        aptx_unpack_codewords,
+    },
+};
+
+struct bench_stage {
+    const char *name;
+    int subband;
+    int (*run)(const struct bench_kernel *kernel, const struct bench_data *data, int subband);
+};
+
+static volatile int32_t bench_sink;
+
+static struct aptx_channel bench_channels[NB_CHANNELS];
+
+static struct aptx_context bench_context;
+
+static struct aptx_context **bench_encoders;
+static struct aptx_context **bench_decoders;
+static unsigned bench_streams = 1;
+
+/*
+ * Block kernels process the captured stream in blocks of QMF_BLOCK_PACKETS
+ * aptX samples like aptx_encode() and aptx_decode() do.
+ */
+static int bench_qmf_tree_analysis_block(const struct bench_kernel *kernel, const struct bench_data *data)
+{
+    int32_t subband_samples[QMF_BLOCK_PACKETS][NB_CHANNELS][NB_SUBBANDS];
+    int32_t sink = 0;
+    unsigned channel;
+    size_t i, packets;
+
+    for (i = 0; i < data->packets; i += packets) {
+        packets = data->packets - i;
+        if (packets > QMF_BLOCK_PACKETS)
+            packets = QMF_BLOCK_PACKETS;
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            kernel->qmf_tree_analysis_block(&bench_channels[channel].qmf, data->pcm + i, channel, packets, subband_samples);
+            sink ^= subband_samples[0][channel][0] ^ subband_samples[packets-1][channel][3];
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_qmf_tree_synthesis_block(const struct bench_kernel *kernel, const struct bench_data *data)
+{
+    int32_t samples[QMF_BLOCK_PACKETS][NB_CHANNELS][4];
+    int32_t sink = 0;
+    unsigned channel;
+    size_t i, packets;
+
+    for (i = 0; i < data->packets; i += packets) {
+        packets = data->packets - i;
+        if (packets > QMF_BLOCK_PACKETS)
+            packets = QMF_BLOCK_PACKETS;
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            kernel->qmf_tree_synthesis_block(&bench_channels[channel].qmf, data->reconstructed + i, channel, packets, samples);
+            sink ^= samples[0][channel][0] ^ samples[packets-1][channel][3];
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_qmf_tree_analysis(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    int32_t subband_samples[NB_SUBBANDS];
+    int32_t sink = 0;
+    unsigned channel;
+    size_t i;
+
+    (void)subband;
+    if (kernel->qmf_tree_analysis_block)
+        return bench_qmf_tree_analysis_block(kernel, data);
+    if (!kernel->qmf_tree_analysis)
+        return 0;
+
+    for (i = 0; i < data->packets; i++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            kernel->qmf_tree_analysis(&bench_channels[channel].qmf, data->pcm[i][channel], subband_samples);
+            sink ^= subband_samples[0] ^ subband_samples[3];
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_qmf_tree_synthesis(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    int32_t samples[4];
+    int32_t sink = 0;
+    unsigned channel;
+    size_t i;
+
+    (void)subband;
+    if (kernel->qmf_tree_synthesis_block)
+        return bench_qmf_tree_synthesis_block(kernel, data);
+    if (!kernel->qmf_tree_synthesis)
+        return 0;
+
+    for (i = 0; i < data->packets; i++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            kernel->qmf_tree_synthesis(&bench_channels[channel].qmf, data->reconstructed[i][channel], samples);
+            sink ^= samples[0] ^ samples[3];
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_quantize_difference(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    const struct aptx_tables *tables = &all_tables[data->hd][subband];
+    struct aptx_quantize quantize;
+    int32_t sink = 0;
+    unsigned channel;
+    size_t i;
+
+    if (!kernel->quantize_difference)
+        return 0;
+
+    for (i = 0; i < data->packets; i++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            kernel->quantize_difference(&quantize,
+                                        data->difference[i][channel][subband],
+                                        data->dither[i][channel][subband],
+                                        data->quantization_factor[i][channel][subband],
+                                        tables);
+            sink ^= quantize.quantized_sample ^ quantize.error;
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_insert_sync(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    uint8_t sync_idx = 0;
+    int32_t sink = 0;
+    unsigned channel, i;
+    size_t packet;
+
+    (void)subband;
+    if (!kernel->insert_sync)
+        return 0;
+
+    for (packet = 0; packet < data->packets; packet++) {
+        /* Restoring quantized samples is part of measured time, it is just few small copies */
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            bench_channels[channel].dither_parity = data->dither_parity[packet][channel];
+            for (i = 0; i < NB_SUBBANDS; i++)
+                bench_channels[channel].quantize[i] = data->quantize[packet][channel][i];
+        }
+        kernel->insert_sync(bench_channels, &sync_idx);
+        sink ^= bench_channels[LEFT].quantize[0].quantized_sample ^ bench_channels[RIGHT].quantize[1].quantized_sample;
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_process_subband(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    const struct aptx_tables *tables = &all_tables[data->hd][subband];
+    struct aptx_channel *c;
+    int32_t sink = 0;
+    unsigned channel;
+    size_t i;
+
+    if (!kernel->process_subband)
+        return 0;
+
+    for (i = 0; i < data->packets; i++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            c = &bench_channels[channel];
+            kernel->process_subband(&c->invert_quantize[subband],
+                                    &c->prediction[subband],
+                                    data->quantize_synced[i][channel][subband].quantized_sample,
+                                    data->dither[i][channel][subband],
+                                    tables);
+            sink ^= c->prediction[subband].predicted_sample;
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_invert_quantize_and_prediction(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    unsigned i;
+
+    (void)subband;
+    if (!kernel->process_subband)
+        return 0;
+
+    for (i = 0; i < NB_SUBBANDS; i++)
+        bench_process_subband(kernel, data, i);
+
+    return 1;
+}
+
+/*
+ * Block kernels store fields of every aptX sample as encoder does and pack
+ * or unpack whole blocks of QMF_BLOCK_PACKETS aptX samples at once.
+ */
+static int bench_pack_block(const struct bench_kernel *kernel, const struct bench_data *data)
+{
+    struct aptx_codewords codewords;
+    uint8_t output[QMF_BLOCK_PACKETS * 6];
+    int32_t sink = 0;
+    unsigned channel, i;
+    size_t packet, n, packets;
+
+    bench_context.hd = (uint8_t)data->hd;
+
+    for (packet = 0; packet < data->packets; packet += packets) {
+        packets = data->packets - packet;
+        if (packets > QMF_BLOCK_PACKETS)
+            packets = QMF_BLOCK_PACKETS;
+        for (n = 0; n < packets; n++) {
+            for (channel = 0; channel < NB_CHANNELS; channel++) {
+                bench_channels[channel].dither_parity = data->dither_parity[packet+n][channel];
+                for (i = 0; i < NB_SUBBANDS; i++)
+                    bench_channels[channel].quantize[i].quantized_sample = data->quantize_synced[packet+n][channel][i].quantized_sample;
+                aptx_get_codeword_fields(&bench_channels[channel], &codewords, channel, n);
+            }
+        }
+        kernel->pack_codewords(&bench_context, &codewords, packets, output);
+        sink ^= output[0] ^ output[packets * 4 - 1];
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_unpack_block(const struct bench_kernel *kernel, const struct bench_data *data)
+{
+    const size_t sample_size = data->hd ? 6 : 4;
+    struct aptx_codewords codewords;
+    int32_t sink = 0;
+    unsigned channel;
+    size_t packet, n, packets;
+
+    bench_context.hd = (uint8_t)data->hd;
+
+    for (packet = 0; packet < data->packets; packet += packets) {
+        packets = data->packets - packet;
+        if (packets > QMF_BLOCK_PACKETS)
+            packets = QMF_BLOCK_PACKETS;
+        kernel->unpack_codewords(&bench_context, data->stream + packet * sample_size, packets, &codewords);
+        for (n = 0; n < packets; n++) {
+            for (channel = 0; channel < NB_CHANNELS; channel++) {
+                bench_channels[channel].dither_parity = data->dither_parity[packet+n][channel];
+                aptx_set_codeword_fields(&bench_channels[channel], &codewords, channel, n);
+                sink ^= bench_channels[channel].quantize[0].quantized_sample ^ bench_channels[channel].quantize[3].quantized_sample;
+            }
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_pack(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    int32_t sink = 0;
+    unsigned channel, i;
+    size_t packet;
+
+    (void)subband;
+    if (kernel->pack_codewords)
+        return bench_pack_block(kernel, data);
+    if (data->hd ? !kernel->hd_pack_codeword : !kernel->pack_codeword)
+        return 0;
+
+    for (packet = 0; packet < data->packets; packet++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            bench_channels[channel].dither_parity = data->dither_parity[packet][channel];
+            for (i = 0; i < NB_SUBBANDS; i++)
+                bench_channels[channel].quantize[i].quantized_sample = data->quantize_synced[packet][channel][i].quantized_sample;
+            if (data->hd)
+                sink ^= (int32_t)kernel->hd_pack_codeword(&bench_channels[channel]);
+            else
+                sink ^= (int32_t)kernel->pack_codeword(&bench_channels[channel]);
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_unpack(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    int32_t sink = 0;
+    unsigned channel;
+    size_t packet;
+
+    (void)subband;
+    if (kernel->unpack_codewords)
+        return bench_unpack_block(kernel, data);
+    if (data->hd ? !kernel->hd_unpack_codeword : !kernel->unpack_codeword)
+        return 0;
+
+    for (packet = 0; packet < data->packets; packet++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            bench_channels[channel].dither_parity = data->dither_parity[packet][channel];
+            if (data->hd)
+                kernel->hd_unpack_codeword(&bench_channels[channel], data->codeword[packet][channel]);
+            else
+                kernel->unpack_codeword(&bench_channels[channel], (uint16_t)data->codeword[packet][channel]);
+            sink ^= bench_channels[channel].quantize[0].quantized_sample ^ bench_channels[channel].quantize[3].quantized_sample;
+        }
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+/*
+ * Whole codec stages process the stream in chunks of BENCH_STREAM_CHUNK aptX
+ * samples, which are distributed round robin to bench_streams independent
+ * contexts. With many streams, state of each context is evicted from caches
+ * before its next chunk, like in a server which encodes many streams, and
+ * the shared quantization tables compete with states of all contexts.
+ */
+static int bench_encode(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    const size_t sample_size = data->hd ? 6 : 4;
+    uint8_t output[BENCH_STREAM_CHUNK * 6];
+    int32_t sink = 0;
+    size_t packet, packets, written;
+    unsigned stream;
+
+    (void)subband;
+    /* Whole codec is only the generic code */
+    if (kernel != &bench_kernels[0])
+        return 0;
+
+    for (packet = 0, stream = 0; packet < data->packets; packet += packets, stream = (stream + 1) % bench_streams) {
+        packets = data->packets - packet;
+        if (packets > BENCH_STREAM_CHUNK)
+            packets = BENCH_STREAM_CHUNK;
+        aptx_encode(bench_encoders[stream], data->input + packet * 3*NB_CHANNELS*4, packets * 3*NB_CHANNELS*4, output, sizeof(output), &written);
+        if (written != packets * sample_size)
+            return 0;
+        sink ^= output[0];
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static int bench_decode(const struct bench_kernel *kernel, const struct bench_data *data, int subband)
+{
+    const size_t sample_size = data->hd ? 6 : 4;
+    uint8_t output[BENCH_STREAM_CHUNK * 3*NB_CHANNELS*4];
+    int32_t sink = 0;
+    size_t packet, packets, written;
+    unsigned stream;
+
+    (void)subband;
+    if (kernel != &bench_kernels[0])
+        return 0;
+
+    /* Chunks are multiple of 8 aptX samples, so every chunk starts with same parity sync position */
+    if (data->packets % BENCH_STREAM_CHUNK != 0)
+        return 0;
+
+    for (packet = 0, stream = 0; packet < data->packets; packet += packets, stream = (stream + 1) % bench_streams) {
+        packets = data->packets - packet;
+        if (packets > BENCH_STREAM_CHUNK)
+            packets = BENCH_STREAM_CHUNK;
+        if (aptx_decode(bench_decoders[stream], data->stream + packet * sample_size, packets * sample_size, output, sizeof(output), &written) != packets * sample_size)
+            return 0;
+        sink ^= output[0];
+    }
+
+    bench_sink ^= sink;
+    return 1;
+}
+
+static const struct bench_stage bench_stages[] = {
+    { "qmf_tree_analysis",               -1, bench_qmf_tree_analysis },
+    { "quantize_difference",              0, bench_quantize_difference },
+    { "quantize_difference",              1, bench_quantize_difference },
+    { "quantize_difference",              2, bench_quantize_difference },
+    { "quantize_difference",              3, bench_quantize_difference },
+    { "insert_sync",                     -1, bench_insert_sync },
+    { "invert_quantize_and_prediction",   0, bench_process_subband },
+    { "invert_quantize_and_prediction",   1, bench_process_subband },
+    { "invert_quantize_and_prediction",   2, bench_process_subband },
+    { "invert_quantize_and_prediction",   3, bench_process_subband },
+    { "invert_quantize_and_prediction",  -1, bench_invert_quantize_and_prediction },
+    { "pack_codeword",                   -1, bench_pack },
+    { "unpack_codeword",                 -1, bench_unpack },
+    { "qmf_tree_synthesis",              -1, bench_qmf_tree_synthesis },
+    { "encode",                          -1, bench_encode },
+    { "decode",                          -1, bench_decode },
+};
+
+static const char *const subband_names[NB_SUBBANDS] = { "LF", "MLF", "MHF", "HF" };
+
+/*
+ * Deterministic test signal: mixture of two sines (as integer approximation
+ * via second order recursive oscillator) and pseudo random noise from LCG.
+ */
+static void bench_generate_signal(struct bench_data *data)
+{
+    int64_t s1 = 0, s2 = 0, c1 = 1 << 22, c2 = 1 << 22;
+    uint32_t seed = 0x12345678;
+    unsigned channel, sample;
+    int32_t noise;
+    size_t i, pos;
+
+    for (i = 0; i < data->packets; i++) {
+        for (sample = 0; sample < 4; sample++) {
+            /* Rotate two phasors by small fixed angles (magic-circle oscillator) */
+            s1 += (c1 * 411) >> 16; c1 -= (s1 * 411) >> 16;
+            s2 += (c2 * 2351) >> 16; c2 -= (s2 * 2351) >> 16;
+            for (channel = 0; channel < NB_CHANNELS; channel++) {
+                seed = seed * 1664525 + 1013904223;
+                noise = (int32_t)(seed >> 12) - (1 << 19);
+                data->pcm[i][channel][sample] = clip_intp2((int32_t)(channel ? s1 : s2) + (int32_t)(channel ? s2 : s1) / 4 + noise, 23);
+                pos = ((i * 4 + sample) * NB_CHANNELS + channel) * 3;
+                data->input[pos+0] = (uint8_t)(((uint32_t)data->pcm[i][channel][sample] >>  0) & 0xFF);
+                data->input[pos+1] = (uint8_t)(((uint32_t)data->pcm[i][channel][sample] >>  8) & 0xFF);
+                data->input[pos+2] = (uint8_t)(((uint32_t)data->pcm[i][channel][sample] >> 16) & 0xFF);
+            }
+        }
+    }
+}
+
+/*
+ * Run real encoder and decoder stages over the signal and record inputs and
+ * outputs of every stage.
+ */
+static void bench_capture(struct bench_data *data)
+{
+    struct aptx_context *ctx;
+    struct aptx_channel *c;
+    unsigned channel, subband;
+    size_t i;
+
+    ctx = aptx_init(data->hd);
+    if (!ctx) {
+        fprintf(stderr, "Cannot initialize aptX context\n");
+        exit(1);
+    }
+
+    for (i = 0; i < data->packets; i++) {
+        /* Same as aptx_encode_samples() with recording of intermediate values */
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            c = &ctx->channels[channel];
+            aptx_qmf_tree_analysis(&c->qmf, data->pcm[i][channel], data->subband_samples[i][channel]);
+            aptx_generate_dither(c);
+            data->dither_parity[i][channel] = c->dither_parity;
+            for (subband = 0; subband < NB_SUBBANDS; subband++) {
+                data->difference[i][channel][subband] = clip_intp2(data->subband_samples[i][channel][subband] - c->prediction[subband].predicted_sample, 23);
+                data->dither[i][channel][subband] = c->dither[subband];
+                data->quantization_factor[i][channel][subband] = c->invert_quantize[subband].quantization_factor;
+                aptx_quantize_difference(&c->quantize[subband],
+                                         data->difference[i][channel][subband],
+                                         c->dither[subband],
+                                         c->invert_quantize[subband].quantization_factor,
+                                         &all_tables[data->hd][subband]);
+                data->quantize[i][channel][subband] = c->quantize[subband];
+            }
+        }
+
+        aptx_insert_sync(ctx->channels, &ctx->sync_idx);
+
+        for (channel = 0; channel < NB_CHANNELS; channel++) {
+            c = &ctx->channels[channel];
+            aptx_invert_quantize_and_prediction(c, data->hd);
+            for (subband = 0; subband < NB_SUBBANDS; subband++) {
+                data->quantize_synced[i][channel][subband] = c->quantize[subband];
+                data->reconstructed[i][channel][subband] = c->prediction[subband].previous_reconstructed_sample;
+            }
+            if (data->hd) {
+                data->codeword[i][channel] = aptxhd_pack_codeword(c);
+                data->stream[6*i+3*channel+0] = (uint8_t)((data->codeword[i][channel] >> 16) & 0xFF);
+                data->stream[6*i+3*channel+1] = (uint8_t)((data->codeword[i][channel] >>  8) & 0xFF);
+                data->stream[6*i+3*channel+2] = (uint8_t)((data->codeword[i][channel] >>  0) & 0xFF);
+            } else {
+                data->codeword[i][channel] = aptx_pack_codeword(c);
+                data->stream[4*i+2*channel+0] = (uint8_t)((data->codeword[i][channel] >> 8) & 0xFF);
+                data->stream[4*i+2*channel+1] = (uint8_t)((data->codeword[i][channel] >> 0) & 0xFF);
+            }
+        }
+    }
+
+    aptx_finish(ctx);
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(const double *sorted, unsigned count, unsigned percentile)
+{
+    unsigned idx = (count * percentile + 99) / 100;
+    if (idx > 0)
+        idx--;
+    return sorted[idx];
+}
+
+static void *bench_alloc(size_t size)
+{
+    void *ptr = calloc(1, size);
+    if (!ptr) {
+        fprintf(stderr, "Cannot allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const variant_names[2] = { "aptX", "aptX HD" };
+    const char *stage_filter = NULL;
+    const char *kernel_filter = NULL;
+    struct bench_data data;
+    unsigned warmup = 10;
+    unsigned repeat = 100;
+    int only_hd = -1;
+    double *times;
+    double start;
+    unsigned k, r;
+    size_t s;
+    char name[64];
+    int hd;
+    int i;
+
+    data.packets = 4096;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            fprintf(stderr, "aptX codec stage microbenchmark %d.%d.%d\n", OPENAPTX_MAJOR, OPENAPTX_MINOR, OPENAPTX_PATCH);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "This utility measures time spent in each aptX encoder and\n");
+            fprintf(stderr, "decoder stage in isolation and prints it in nanoseconds\n");
+            fprintf(stderr, "per one aptX sample (4 stereo samples) for every kernel\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Usage:\n");
+            fprintf(stderr, "        %s [options]\n", argv[0]);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Options:\n");
+            fprintf(stderr, "        -h, --help         Display this help\n");
+            fprintf(stderr, "        --hd               Measure only aptX HD\n");
+            fprintf(stderr, "        --no-hd            Measure only aptX\n");
+            fprintf(stderr, "        --stage NAME       Measure only stage NAME\n");
+            fprintf(stderr, "        --kernel NAME      Measure only kernel NAME\n");
+            fprintf(stderr, "        --packets N        Process N aptX samples in one run (default %lu)\n", (unsigned long)data.packets);
+            fprintf(stderr, "        --warmup N         Do N unmeasured runs before measuring (default %u)\n", warmup);
+            fprintf(stderr, "        --repeat N         Do N measured runs (default %u)\n", repeat);
+            fprintf(stderr, "        --streams N        Interleave N streams in stages encode and decode (default %u)\n", bench_streams);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Available kernels:");
+            for (k = 0; k < ARRAY_SIZE(bench_kernels); k++)
+                fprintf(stderr, " %s", bench_kernels[k].name);
+            fprintf(stderr, "\n");
+            return 1;
+        } else if (strcmp(argv[i], "--hd") == 0) {
+            only_hd = 1;
+        } else if (strcmp(argv[i], "--no-hd") == 0) {
+            only_hd = 0;
+        } else if (strcmp(argv[i], "--stage") == 0 && i+1 < argc) {
+            stage_filter = argv[++i];
+        } else if (strcmp(argv[i], "--kernel") == 0 && i+1 < argc) {
+            kernel_filter = argv[++i];
+        } else if (strcmp(argv[i], "--packets") == 0 && i+1 < argc) {
+            data.packets = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i+1 < argc) {
+            warmup = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i+1 < argc) {
+            repeat = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--streams") == 0 && i+1 < argc) {
+            bench_streams = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "%s: Invalid option %s\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+
+    if (data.packets == 0 || data.packets > BENCH_MAX_PACKETS || repeat == 0 || repeat > BENCH_MAX_REPEAT) {
+        fprintf(stderr, "%s: Invalid number of packets or repeats\n", argv[0]);
+        return 1;
+    }
+
+    if (bench_streams == 0 || bench_streams > BENCH_MAX_STREAMS) {
+        fprintf(stderr, "%s: Invalid number of streams\n", argv[0]);
+        return 1;
+    }
+
+    data.pcm = bench_alloc(data.packets * sizeof(*data.pcm));
+    data.input = bench_alloc(data.packets * 3*NB_CHANNELS*4);
+    data.subband_samples = bench_alloc(data.packets * sizeof(*data.subband_samples));
+    data.difference = bench_alloc(data.packets * sizeof(*data.difference));
+    data.dither = bench_alloc(data.packets * sizeof(*data.dither));
+    data.dither_parity = bench_alloc(data.packets * sizeof(*data.dither_parity));
+    data.quantization_factor = bench_alloc(data.packets * sizeof(*data.quantization_factor));
+    data.quantize = bench_alloc(data.packets * sizeof(*data.quantize));
+    data.quantize_synced = bench_alloc(data.packets * sizeof(*data.quantize_synced));
+    data.codeword = bench_alloc(data.packets * sizeof(*data.codeword));
+    data.stream = bench_alloc(data.packets * 6);
+    data.reconstructed = bench_alloc(data.packets * sizeof(*data.reconstructed));
+    times = bench_alloc(repeat * sizeof(*times));
+    bench_encoders = bench_alloc(bench_streams * sizeof(*bench_encoders));
+    bench_decoders = bench_alloc(bench_streams * sizeof(*bench_decoders));
+
+    bench_generate_signal(&data);
+
+    printf("Time in nanoseconds per one aptX sample (4 stereo samples)\n");
+    printf("%-36s %-8s %-10s %10s %10s %10s %10s\n", "stage", "variant", "kernel", "min", "median", "p90", "p99");
+
+    for (hd = 0; hd < 2; hd++) {
+        if (only_hd >= 0 && only_hd != hd)
+            continue;
+
+        data.hd = hd;
+        bench_capture(&data);
+
+        for (k = 0; k < bench_streams; k++) {
+            bench_encoders[k] = aptx_init(hd);
+            bench_decoders[k] = aptx_init(hd);
+            if (!bench_encoders[k] || !bench_decoders[k]) {
+                fprintf(stderr, "Cannot initialize aptX context\n");
+                return 1;
+            }
+        }
+
+        for (s = 0; s < ARRAY_SIZE(bench_stages); s++) {
+            if (stage_filter && strcmp(stage_filter, bench_stages[s].name) != 0)
+                continue;
+
+            if (bench_stages[s].subband >= 0)
+                snprintf(name, sizeof(name), "%s/%s", bench_stages[s].name, subband_names[bench_stages[s].subband]);
+            else
+                snprintf(name, sizeof(name), "%s", bench_stages[s].name);
+
+            for (k = 0; k < ARRAY_SIZE(bench_kernels); k++) {
+                if (kernel_filter && strcmp(kernel_filter, bench_kernels[k].name) != 0)
+                    continue;
+
+                memset(bench_channels, 0, sizeof(bench_channels));
+
+                for (r = 0; r < warmup; r++)
+                    if (!bench_stages[s].run(&bench_kernels[k], &data, bench_stages[s].subband))
+                        break;
+                if (warmup > 0 && r < warmup)
+                    continue;
+
+                for (r = 0; r < repeat; r++) {
+                    start = bench_now();
+                    if (!bench_stages[s].run(&bench_kernels[k], &data, bench_stages[s].subband))
+                        break;
+                    times[r] = (bench_now() - start) / (double)data.packets;
+                }
+                if (r < repeat)
+                    continue;
+
+                qsort(times, repeat, sizeof(*times), bench_compare);
+                printf("%-36s %-8s %-10s %10.2f %10.2f %10.2f %10.2f\n", name, variant_names[hd], bench_kernels[k].name,
+                       times[0], bench_percentile(times, repeat, 50), bench_percentile(times, repeat, 90), bench_percentile(times, repeat, 99));
+            }
+        }
+
+        for (k = 0; k < bench_streams; k++) {
+            aptx_finish(bench_encoders[k]);
+            aptx_finish(bench_decoders[k]);
+        }
+    }
+
+    free(times);
+    free(bench_encoders);
+    free(bench_decoders);
+    free(data.pcm);
+    free(data.input);
+    free(data.subband_samples);
+    free(data.difference);
+    free(data.dither);
+    free(data.dither_parity);
+    free(data.quantization_factor);
+    free(data.quantize);
+    free(data.quantize_synced);
+    free(data.codeword);
+    free(data.stream);
+    free(data.reconstructed);
+
+    return 0;
+}
@@ -0,0 +1,1550 @@
+/*
+ * aptX codec bit-exact conformance check
+ * Copyright (C) 2018-2021  Pali Rohár <pali.rohar@gmail.com>
+ *
+ * Read README file for license details.  Due to license abuse
+ * this program must not be used in any Freedesktop project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Check needs access to internal codec paths, so include library source directly */
+#include "openaptx.c"
+
+/*
+ * Reference corpus is generated by deterministic integer code, so it is same
+ * on every platform. Golden values are FNV-1a hashes and sizes of encoded
+ * stream (including aptx_encode_finish() output) and of decoded stream.
+ */
+struct check_signal {
+    const char *name;
+    size_t samples;
+    void (*generate)(int32_t (*pcm)[NB_CHANNELS], size_t samples);
+};
+
+struct check_golden {
+    const char *name;
+    int hd;
+    size_t encoded_size;
+    uint64_t encoded_hash;
+    size_t decoded_size;
+    uint64_t decoded_hash;
+};
+
+struct check_output {
+    unsigned char *encoded;
+    size_t encoded_size;
+    unsigned char *decoded;
+    size_t decoded_size;
+};
+
+/*
+ * Alternative code paths which must produce bit identical output as the
+ * portable path (the first entry). Every new specialized kernel has to be
+ * added into this table.
+ */
+struct check_variant {
+    const char *name;
+    int (*run)(int hd, const unsigned char *input, size_t input_size, struct check_output *output);
+};
+
+static uint32_t check_seed;
+
+static int32_t check_random(unsigned bits)
+{
+    check_seed = check_seed * 1664525 + 1013904223;
+    return (int32_t)(check_seed >> (32 - bits)) - ((int32_t)1 << (bits - 1));
+}
+
+static void check_generate_silence(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    size_t i;
+    for (i = 0; i < samples; i++)
+        pcm[i][LEFT] = pcm[i][RIGHT] = 0;
+}
+
+static void check_generate_clipping(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    size_t i;
+    for (i = 0; i < samples; i++) {
+        pcm[i][LEFT] = ((i / 50) & 1) ? 0x7FFFFF : -0x800000;
+        pcm[i][RIGHT] = ((i / 37) & 1) ? -0x800000 : 0x7FFFFF;
+    }
+}
+
+/*
+ * Sine sweep from about 10 Hz to 20 kHz realized by magic circle oscillator
+ * with increasing angular step.
+ */
+static void check_generate_sweep(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    int64_t s = 0, c = (int64_t)1 << 22;
+    int64_t step;
+    size_t i;
+
+    for (i = 0; i < samples; i++) {
+        step = 100 + (int64_t)(190000 - 100) * (int64_t)i / (int64_t)samples;
+        s += (c * step) >> 16;
+        c -= (s * step) >> 16;
+        pcm[i][LEFT] = clip_intp2((int32_t)s, 23);
+        pcm[i][RIGHT] = clip_intp2((int32_t)-c, 23);
+    }
+}
+
+static void check_generate_noise(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    size_t i;
+    check_seed = 1;
+    for (i = 0; i < samples; i++) {
+        pcm[i][LEFT] = check_random(24);
+        pcm[i][RIGHT] = check_random(24);
+    }
+}
+
+/*
+ * Very low level noise has small quantization errors with many ties in
+ * aptx_insert_sync(), so it exercises parity insertion heavily.
+ */
+static void check_generate_parity(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    size_t i;
+    check_seed = 2;
+    for (i = 0; i < samples; i++) {
+        pcm[i][LEFT] = check_random(3);
+        pcm[i][RIGHT] = check_random(2);
+    }
+}
+
+static void check_generate_impulses(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    size_t i;
+    for (i = 0; i < samples; i++) {
+        pcm[i][LEFT] = (i % 441 == 0) ? 0x7FFFFF : 0;
+        pcm[i][RIGHT] = (i % 882 == 441) ? -0x800000 : 0;
+    }
+}
+
+static void check_generate_mono(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    int64_t s = 0, c = (int64_t)1 << 21;
+    size_t i;
+
+    check_seed = 3;
+    for (i = 0; i < samples; i++) {
+        s += (c * 1500) >> 16;
+        c -= (s * 1500) >> 16;
+        pcm[i][LEFT] = pcm[i][RIGHT] = clip_intp2((int32_t)s + check_random(12), 23);
+    }
+}
+
+/*
+ * Tone bursts separated by long gaps of digital silence.
+ */
+static void check_generate_bursts(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    int64_t s = 0, c = (int64_t)1 << 20;
+    size_t i;
+
+    for (i = 0; i < samples; i++) {
+        s += (c * 5000) >> 16;
+        c -= (s * 5000) >> 16;
+        if ((i / 4410) % 3 == 0) {
+            pcm[i][LEFT] = clip_intp2((int32_t)s, 23);
+            pcm[i][RIGHT] = clip_intp2((int32_t)c, 23);
+        } else {
+            pcm[i][LEFT] = pcm[i][RIGHT] = 0;
+        }
+    }
+}
+
+/*
+ * Tone of 441 Hz at -6 dBFS in left channel and at -18 dBFS in right channel.
+ * It is not part of reference corpus, it is used by variants which need
+ * signal with known level and with all energy in the lowest subband.
+ */
+static void check_generate_tone(int32_t (*pcm)[NB_CHANNELS], size_t samples)
+{
+    int64_t s = 0, c = (int64_t)1 << 22;
+    size_t i;
+
+    for (i = 0; i < samples; i++) {
+        s += (c * 4118) >> 16;
+        c -= (s * 4118) >> 16;
+        pcm[i][LEFT] = clip_intp2((int32_t)s, 23);
+        pcm[i][RIGHT] = clip_intp2((int32_t)(s >> 2), 23);
+    }
+}
+
+static const struct check_signal check_tone = { "tone", 22050, check_generate_tone };
+
+static const struct check_signal check_signals[] = {
+    { "silence",  16384, check_generate_silence },
+    { "clipping", 22050, check_generate_clipping },
+    { "sweep",    44100, check_generate_sweep },
+    { "noise",    22050, check_generate_noise },
+    { "parity",   22050, check_generate_parity },
+    { "impulses", 22050, check_generate_impulses },
+    { "mono",     22050, check_generate_mono },
+    { "bursts",   44101, check_generate_bursts },
+};
+
+static const struct check_golden check_goldens[] = {
+    { "silence", 0, 16476, UINT64_C(0xfe46dede1d591c8c), 98316, UINT64_C(0x26a125614b1f4238) },
+    { "silence", 1, 24714, UINT64_C(0x5f19f37cba8b517a), 98316, UINT64_C(0x7b9122c6117a8c48) },
+    { "clipping", 0, 22140, UINT64_C(0x5b495cbba98900b6), 132300, UINT64_C(0xe3949aabc28b293e) },
+    { "clipping", 1, 33210, UINT64_C(0xda095bf6d69c1f4c), 132300, UINT64_C(0x7b88cf2e8f142a43) },
+    { "sweep", 0, 44192, UINT64_C(0x0c8d7c4dc7f4c42b), 264612, UINT64_C(0xfe0921ce3facfd30) },
+    { "sweep", 1, 66288, UINT64_C(0xf8812fa2bfa99f2f), 264612, UINT64_C(0xe7b34fa278995b32) },
+    { "noise", 0, 22140, UINT64_C(0x2561e4fdcb8740d4), 132300, UINT64_C(0x263ab53161295f8c) },
+    { "noise", 1, 33210, UINT64_C(0xce58c395f46d1f78), 132300, UINT64_C(0xdde8d69f4efb2e80) },
+    { "parity", 0, 22140, UINT64_C(0xd7af619f215ec70b), 132300, UINT64_C(0xb5ff17d27f1ee27f) },
+    { "parity", 1, 33210, UINT64_C(0x64f13acaa504570d), 132300, UINT64_C(0x32bf8c45a4b2c447) },
+    { "impulses", 0, 22140, UINT64_C(0xb943da4ce89137ac), 132300, UINT64_C(0x1ad944255c45a67b) },
+    { "impulses", 1, 33210, UINT64_C(0x95e5d9b96ce11287), 132300, UINT64_C(0x049526963348a795) },
+    { "mono", 0, 22140, UINT64_C(0x438c824ef068c624), 132300, UINT64_C(0x66568509c644a363) },
+    { "mono", 1, 33210, UINT64_C(0x5bbbcc4552277f98), 132300, UINT64_C(0x2bf463d78abd3bc9) },
+    { "bursts", 0, 44192, UINT64_C(0x5898fc1633cdd2fb), 264612, UINT64_C(0xd4b579c94cee822a) },
+    { "bursts", 1, 66288, UINT64_C(0xde0e6453ea7609e1), 264612, UINT64_C(0x3845ddcc4302cc5a) },
+};
+
+static uint64_t check_hash(const unsigned char *data, size_t size)
+{
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+
+    return hash;
+}
+
+static void *check_alloc(size_t size)
+{
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        fprintf(stderr, "Cannot allocate memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static int32_t check_read_sample(const unsigned char *data)
+{
+    return sign_extend((int32_t)(data[0] | (data[1] << 8) | (data[2] << 16)), 24);
+}
+
+static unsigned char *check_generate(const struct check_signal *signal, size_t *size)
+{
+    int32_t (*pcm)[NB_CHANNELS];
+    unsigned char *input;
+    unsigned channel;
+    size_t i, pos;
+
+    pcm = check_alloc(signal->samples * sizeof(*pcm));
+    input = check_alloc(signal->samples * 3*NB_CHANNELS);
+
+    check_seed = 0;
+    signal->generate(pcm, signal->samples);
+
+    for (i = 0, pos = 0; i < signal->samples; i++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++, pos += 3) {
+            input[pos+0] = (uint8_t)(((uint32_t)pcm[i][channel] >>  0) & 0xFF);
+            input[pos+1] = (uint8_t)(((uint32_t)pcm[i][channel] >>  8) & 0xFF);
+            input[pos+2] = (uint8_t)(((uint32_t)pcm[i][channel] >> 16) & 0xFF);
+        }
+    }
+
+    free(pcm);
+    *size = pos;
+    return input;
+}
+
+/*
+ * Maximal sizes of encoded and decoded streams for given input size.
+ */
+static size_t check_encoded_size(size_t input_size)
+{
+    return (input_size / (3*NB_CHANNELS*4) + (LATENCY_SAMPLES+3)/4) * 6;
+}
+
+static size_t check_decoded_size(size_t encoded_size, int hd)
+{
+    return (encoded_size / (hd == 1 ? 6 : 4) + 1) * 3*NB_CHANNELS*4;
+}
+
+static void check_init_output(int hd, size_t input_size, struct check_output *output)
+{
+    output->encoded = check_alloc(check_encoded_size(input_size));
+    output->decoded = check_alloc(check_decoded_size(check_encoded_size(input_size), hd));
+    output->encoded_size = 0;
+    output->decoded_size = 0;
+}
+
+static int check_run_portable(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t encoded_size = check_encoded_size(input_size);
+    struct aptx_context *ctx;
+    size_t written;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    aptx_encode(ctx, input, input_size, output->encoded, encoded_size, &written);
+    output->encoded_size = written;
+    if (!aptx_encode_finish(ctx, output->encoded + output->encoded_size, encoded_size - output->encoded_size, &written)) {
+        aptx_finish(ctx);
+        return 0;
+    }
+    output->encoded_size += written;
+
+    if (aptx_decode(ctx, output->encoded, output->encoded_size, output->decoded, check_decoded_size(output->encoded_size, hd), &written) != output->encoded_size) {
+        aptx_finish(ctx);
+        return 0;
+    }
+    output->decoded_size = written;
+
+    aptx_finish(ctx);
+    return 1;
+}
+
+/*
+ * Process stream by one aptX sample per call, with smallest possible buffers.
+ */
+static int check_run_packet(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    struct aptx_context *ctx;
+    size_t ipos, written;
+    int ret;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    for (ipos = 0; ipos + 3*NB_CHANNELS*4 <= input_size; ipos += 3*NB_CHANNELS*4) {
+        aptx_encode(ctx, input + ipos, 3*NB_CHANNELS*4, output->encoded + output->encoded_size, sample_size, &written);
+        output->encoded_size += written;
+    }
+
+    do {
+        ret = aptx_encode_finish(ctx, output->encoded + output->encoded_size, sample_size, &written);
+        output->encoded_size += written;
+    } while (!ret);
+
+    for (ipos = 0; ipos < output->encoded_size; ipos += sample_size) {
+        if (aptx_decode(ctx, output->encoded + ipos, sample_size, output->decoded + output->decoded_size, 3*NB_CHANNELS*4, &written) != sample_size) {
+            aptx_finish(ctx);
+            return 0;
+        }
+        output->decoded_size += written;
+    }
+
+    aptx_finish(ctx);
+    return 1;
+}
+
+/*
+ * Process stream in chunks of varying size, not aligned to samples and not
+ * to blocks of QMF_BLOCK_PACKETS aptX samples, with output buffers smaller
+ * than needed for the whole chunk.
+ */
+static int check_run_block(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    const size_t encoded_size = check_encoded_size(input_size);
+    const size_t decoded_size = check_decoded_size(encoded_size, hd);
+    struct aptx_context *ctx;
+    size_t ipos, length, space, written, step;
+    int ret;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    for (ipos = 0, step = 0; ipos + 3*NB_CHANNELS*4 <= input_size; step++) {
+        length = (step * 7 % (3*QMF_BLOCK_PACKETS)) * 3*NB_CHANNELS*4 + step % 5;
+        space = (step * 11 % (2*QMF_BLOCK_PACKETS) + 1) * sample_size;
+        if (length > input_size - ipos)
+            length = input_size - ipos;
+        if (space > encoded_size - output->encoded_size)
+            space = encoded_size - output->encoded_size;
+        ipos += aptx_encode(ctx, input + ipos, length, output->encoded + output->encoded_size, space, &written);
+        output->encoded_size += written;
+    }
+
+    do {
+        ret = aptx_encode_finish(ctx, output->encoded + output->encoded_size, encoded_size - output->encoded_size, &written);
+        output->encoded_size += written;
+    } while (!ret);
+
+    for (ipos = 0, step = 0; ipos < output->encoded_size; step++) {
+        length = (step * 13 % (3*QMF_BLOCK_PACKETS)) * sample_size + step % 3;
+        space = (step * 5 % (2*QMF_BLOCK_PACKETS) + 1) * 3*NB_CHANNELS*4 + step % 7;
+        if (length > output->encoded_size - ipos)
+            length = output->encoded_size - ipos;
+        if (space > decoded_size - output->decoded_size)
+            space = decoded_size - output->decoded_size;
+        ipos += aptx_decode(ctx, output->encoded + ipos, length, output->decoded + output->decoded_size, space, &written);
+        output->decoded_size += written;
+        if (step > output->encoded_size) {
+            aptx_finish(ctx);
+            return 0;
+        }
+    }
+
+    aptx_finish(ctx);
+    return 1;
+}
+
+/*
+ * Decode valid stream by aptx_decode_sync() in chunks not aligned to samples,
+ * with output buffers which often fill up before the whole chunk is decoded.
+ * Full output buffer must not be taken as loss of synchronization.
+ */
+static int check_run_decode_sync(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t chunk = 1001;
+    struct aptx_context *ctx;
+    struct aptx_stats stats;
+    size_t ipos, cpos, length, space, written, dropped, step;
+    int synced;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    output->decoded_size = 0;
+    for (ipos = 0, step = 0; ipos < output->encoded_size; ipos += length) {
+        length = output->encoded_size - ipos;
+        if (length > chunk)
+            length = chunk;
+        for (cpos = 0; cpos < length; step++) {
+            space = (step * 5 % 40 + 1) * 3*NB_CHANNELS*4 + step % 7;
+            cpos += aptx_decode_sync(ctx, output->encoded + ipos + cpos, length - cpos, output->decoded + output->decoded_size, space, &written, &synced, &dropped);
+            output->decoded_size += written;
+            if (dropped || step > output->encoded_size) {
+                aptx_finish(ctx);
+                return 0;
+            }
+        }
+    }
+
+    if (aptx_decode_sync_finish(ctx) != 0) {
+        aptx_finish(ctx);
+        return 0;
+    }
+
+    aptx_get_stats(ctx, &stats);
+    aptx_finish(ctx);
+    return stats.sync_lost == 0 && stats.realigned == 0 && stats.dropped == 0;
+}
+
+/*
+ * Cut 11 bytes from the middle of encoded stream, so the rest of stream is
+ * misaligned, and decode it by aptx_decode_sync(). Decoder must realign once
+ * without losing synchronization, dropping only the bytes up to the next
+ * boundary of original aptX samples, and decode all other aptX samples.
+ * Position shifted by one channel codeword passes parity check when both
+ * channels are same (e.g. silence), so the cut is chosen such that the correct
+ * position is tried before it. Then decode it again in two calls split inside
+ * the aptX sample which fails parity check, so realignment starts from
+ * internal cache of aptx_decode_sync().
+ */
+#define CHECK_REALIGN_CUT 11
+
+static int check_run_realign(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    const size_t aligned = (sample_size - CHECK_REALIGN_CUT % sample_size) % sample_size;
+    struct aptx_context *ctx;
+    struct aptx_stats stats;
+    unsigned char *damaged, *decoded, *split_decoded;
+    size_t cut, damaged_size, written, dropped, buffered;
+    size_t failed, split, split_written, split_dropped, written2, dropped2;
+    int synced;
+    int ret;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    /* Stream must be long enough for the realignment lookahead */
+    if (output->encoded_size < 64 * sample_size)
+        return 1;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    cut = output->encoded_size / sample_size / 2 * sample_size + 1;
+    damaged_size = output->encoded_size - CHECK_REALIGN_CUT;
+    damaged = check_alloc(damaged_size);
+    memcpy(damaged, output->encoded, cut);
+    memcpy(damaged + cut, output->encoded + cut + CHECK_REALIGN_CUT, damaged_size - cut);
+
+    decoded = check_alloc(output->decoded_size);
+    ret = aptx_decode_sync(ctx, damaged, damaged_size, decoded, output->decoded_size, &written, &synced, &dropped) == damaged_size && synced;
+    aptx_get_stats(ctx, &stats);
+    buffered = aptx_decode_sync_finish(ctx);
+    aptx_finish(ctx);
+
+    ret = ret && stats.realigned == 1 && stats.sync_lost == 0 && stats.dropped == dropped &&
+          dropped == aligned && buffered == 0 && stats.decoded * sample_size + dropped == damaged_size &&
+          written == output->decoded_size - (output->encoded_size / sample_size - stats.decoded) * 3*NB_CHANNELS*4;
+
+    /* Same realignment must happen when the failed aptX sample is split between two calls at any byte */
+    split_decoded = check_alloc(output->decoded_size);
+    ctx = aptx_init(hd);
+    failed = ctx ? aptx_decode(ctx, damaged, damaged_size, split_decoded, output->decoded_size, &split_written) : 0;
+    aptx_finish(ctx);
+    for (split = failed + 1; ret && split < failed + sample_size; split++) {
+        ctx = aptx_init(hd);
+        if (!ctx) {
+            ret = 0;
+            break;
+        }
+        ret = aptx_decode_sync(ctx, damaged, split, split_decoded, output->decoded_size, &split_written, &synced, &split_dropped) == split;
+        ret = ret && aptx_decode_sync(ctx, damaged + split, damaged_size - split, split_decoded + split_written, output->decoded_size - split_written, &written2, &synced, &dropped2) == damaged_size - split && synced;
+        aptx_get_stats(ctx, &stats);
+        aptx_finish(ctx);
+        ret = ret && stats.realigned == 1 && stats.sync_lost == 0 && split_dropped + dropped2 == dropped &&
+              split_written + written2 == written && memcmp(split_decoded, decoded, written) == 0;
+    }
+
+    free(split_decoded);
+    free(damaged);
+    free(decoded);
+    return ret;
+}
+
+/*
+ * Decode valid stream by aptx_decode_sync() with error tolerance mode, which
+ * must not change anything for stream without errors.
+ */
+static int check_run_tolerance(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    struct aptx_context *ctx;
+    struct aptx_stats stats;
+    size_t written, dropped;
+    int synced;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    aptx_set_error_tolerance(ctx, 2);
+    if (aptx_decode_sync(ctx, output->encoded, output->encoded_size, output->decoded, check_decoded_size(output->encoded_size, hd) + 3*NB_CHANNELS*4, &written, &synced, &dropped) != output->encoded_size || dropped || !synced) {
+        aptx_finish(ctx);
+        return 0;
+    }
+    output->decoded_size = written;
+
+    aptx_get_stats(ctx, &stats);
+    aptx_finish(ctx);
+    return stats.parity_errors == 0 && stats.tolerated == 0 && stats.realigned == 0;
+}
+
+/*
+ * Flip transmitted parity bit in left channel codeword of some aptX samples,
+ * so their parity check fails, and decode by aptx_decode() with tolerance of
+ * two failures in 16 aptX samples. Two pairs of flipped aptX samples far from
+ * each other are within tolerance, decoding passes them through and output
+ * before them is unchanged and after them stays close to the original one.
+ * Third flipped aptX sample after the second pair is beyond tolerance, so
+ * decoding has to stop on it.
+ */
+static int check_run_bit_errors(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    const unsigned char flip_mask = hd ? 0x08 : 0x20;
+    unsigned char state[APTX_CONTEXT_SIZE], state2[APTX_CONTEXT_SIZE];
+    struct aptx_context *ctx;
+    struct aptx_stats stats;
+    unsigned char *damaged, *decoded;
+    size_t packets, flipped[5], first_output, written, i;
+    int32_t value, ref_value;
+    double signal_energy, error_energy;
+    int ret;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    packets = output->encoded_size / sample_size;
+    flipped[0] = packets / 3;
+    flipped[1] = flipped[0] + 5;
+    flipped[2] = flipped[0] + 100;
+    flipped[3] = flipped[2] + 3;
+    flipped[4] = flipped[3] + 7;
+
+    damaged = check_alloc(output->encoded_size);
+    decoded = check_alloc(output->decoded_size);
+    memcpy(damaged, output->encoded, output->encoded_size);
+    for (i = 0; i < 4; i++)
+        damaged[flipped[i] * sample_size] ^= flip_mask;
+
+    ctx = aptx_init(hd);
+    if (!ctx) {
+        free(damaged);
+        free(decoded);
+        return 0;
+    }
+
+    aptx_set_error_tolerance(ctx, 2);
+    ret = aptx_decode(ctx, damaged, output->encoded_size, decoded, output->decoded_size, &written) == output->encoded_size &&
+          written == output->decoded_size;
+    aptx_get_stats(ctx, &stats);
+    ret = ret && stats.parity_errors == 4 && stats.tolerated == 4 && stats.decoded == packets - 4;
+
+    /* Output of aptX samples before the first flipped one is not affected */
+    first_output = (4 * flipped[0] - LATENCY_SAMPLES) * 3*NB_CHANNELS;
+    ret = ret && memcmp(decoded, output->decoded, first_output) == 0;
+
+    /* Error after flipped bits is at least 20 dB below signal or below 4 LSB for nearly silent signals */
+    signal_energy = error_energy = 0;
+    for (i = first_output; ret && i < written; i += 3) {
+        value = sign_extend((int32_t)(decoded[i] | (decoded[i+1] << 8) | (decoded[i+2] << 16)), 24);
+        ref_value = sign_extend((int32_t)(output->decoded[i] | (output->decoded[i+1] << 8) | (output->decoded[i+2] << 16)), 24);
+        signal_energy += (double)ref_value * ref_value;
+        error_energy += (double)(value - ref_value) * (value - ref_value);
+    }
+    ret = ret && error_energy <= signal_energy / 100 + 16.0 * (written - first_output) / 3;
+
+    /* Three failures within 16 aptX samples are beyond tolerance */
+    damaged[flipped[4] * sample_size] ^= flip_mask;
+    aptx_reset(ctx);
+    aptx_reset_stats(ctx);
+    ret = ret && aptx_decode(ctx, damaged, output->encoded_size, decoded, output->decoded_size, &written) == flipped[4] * sample_size;
+    aptx_get_stats(ctx, &stats);
+    ret = ret && stats.parity_errors == 4 && stats.tolerated == 4 && stats.decoded == flipped[4] - 4;
+
+    /* Rejected aptX sample changes neither decoder state nor statistics, so decoding it again fails again */
+    ret = ret && aptx_context_save(ctx, state, sizeof(state)) == APTX_CONTEXT_SIZE;
+    ret = ret && aptx_decode(ctx, damaged + flipped[4] * sample_size, output->encoded_size - flipped[4] * sample_size, decoded, output->decoded_size, &written) == 0;
+    ret = ret && aptx_context_save(ctx, state2, sizeof(state2)) == APTX_CONTEXT_SIZE && memcmp(state, state2, sizeof(state)) == 0;
+    aptx_get_stats(ctx, &stats);
+    ret = ret && stats.parity_errors == 4 && stats.tolerated == 4 && stats.decoded == flipped[4] - 4;
+
+    aptx_finish(ctx);
+    free(damaged);
+    free(decoded);
+    return ret;
+}
+
+/*
+ * Replace CHECK_CONCEAL_PACKETS aptX samples in the middle of stream by
+ * aptx_decode_conceal() and verify its output length and counters. Dither of
+ * concealed aptX sample must be generated from the last received one, so it
+ * equals dither of full decoding. Decoding continues after the loss without
+ * parity failure and its output returns close to the output of full decoding.
+ */
+#define CHECK_CONCEAL_PACKETS 3
+
+static int check_run_conceal(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    struct aptx_context *ctx, *ref_ctx;
+    struct aptx_stats stats;
+    unsigned char *decoded;
+    size_t packets, lost, target, resume, written, decoded_size, i;
+    unsigned channel, subband;
+    int32_t value, ref_value;
+    double signal_energy, error_energy;
+    int ret;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    packets = output->encoded_size / sample_size;
+    lost = packets / 2;
+    target = lost * sample_size;
+    resume = target + CHECK_CONCEAL_PACKETS * sample_size;
+
+    ctx = aptx_init(hd);
+    ref_ctx = aptx_init(hd);
+    if (!ctx || !ref_ctx) {
+        aptx_finish(ctx);
+        aptx_finish(ref_ctx);
+        return 0;
+    }
+
+    decoded = check_alloc(output->decoded_size);
+
+    /* Reference context decodes also the first lost aptX sample */
+    ret = aptx_decode(ctx, output->encoded, target, decoded, output->decoded_size, &written) == target &&
+          aptx_decode_skip(ref_ctx, output->encoded, target + sample_size) == target + sample_size;
+    decoded_size = written;
+
+    if (ret) {
+        ret = aptx_decode_conceal(ctx, 1, decoded + decoded_size, output->decoded_size - decoded_size, &written) == 1 &&
+              written == 3*NB_CHANNELS*4;
+        decoded_size += written;
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            for (subband = 0; subband < NB_SUBBANDS; subband++)
+                ret = ret && ctx->channels[channel].dither[subband] == ref_ctx->channels[channel].dither[subband];
+    }
+
+    if (ret) {
+        ret = aptx_decode_conceal(ctx, CHECK_CONCEAL_PACKETS - 1, decoded + decoded_size, output->decoded_size - decoded_size, &written) == CHECK_CONCEAL_PACKETS - 1 &&
+              written == (CHECK_CONCEAL_PACKETS - 1) * 3*NB_CHANNELS*4;
+        decoded_size += written;
+    }
+
+    if (ret) {
+        ret = aptx_decode(ctx, output->encoded + resume, output->encoded_size - resume, decoded + decoded_size, output->decoded_size - decoded_size, &written) == output->encoded_size - resume;
+        decoded_size += written;
+    }
+
+    aptx_get_stats(ctx, &stats);
+    aptx_finish(ctx);
+    aptx_finish(ref_ctx);
+
+    ret = ret && decoded_size == output->decoded_size &&
+          stats.concealed == CHECK_CONCEAL_PACKETS &&
+          stats.decoded == packets - CHECK_CONCEAL_PACKETS &&
+          stats.parity_errors == 0;
+
+    /*
+     * Predictors converge back, so error of the last 1000 stereo samples is at
+     * least 20 dB below signal or below 4 LSB for nearly silent signals.
+     */
+    signal_energy = error_energy = 0;
+    for (i = (decoded_size > 1000*3*NB_CHANNELS) ? decoded_size - 1000*3*NB_CHANNELS : 0; ret && i < decoded_size; i += 3) {
+        value = sign_extend((int32_t)(decoded[i] | (decoded[i+1] << 8) | (decoded[i+2] << 16)), 24);
+        ref_value = sign_extend((int32_t)(output->decoded[i] | (output->decoded[i+1] << 8) | (output->decoded[i+2] << 16)), 24);
+        signal_energy += (double)ref_value * ref_value;
+        error_energy += (double)(value - ref_value) * (value - ref_value);
+    }
+
+    free(decoded);
+    return ret && error_energy <= signal_energy / 100 + 16.0 * 1000*NB_CHANNELS;
+}
+
+/*
+ * Move encoder in the middle of stream into other context via serialized
+ * state and move decoder into cloned context. State with more bytes in
+ * aptx_decode_sync() buffer than fit before the last byte of one aptX sample
+ * or with predictor state out of its range must be rejected.
+ */
+static int check_run_context(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t encoded_size = check_encoded_size(input_size);
+    const size_t split = (input_size / (3*NB_CHANNELS*4) / 2) * (3*NB_CHANNELS*4);
+    unsigned char state[APTX_CONTEXT_SIZE];
+    struct aptx_context *ctx, *ctx2;
+    size_t written, processed;
+
+    ctx = aptx_init(hd);
+    ctx2 = aptx_init(!hd);
+    if (!ctx || !ctx2) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        return 0;
+    }
+
+    aptx_encode(ctx, input, split, output->encoded, encoded_size, &written);
+    output->encoded_size = written;
+
+    if (aptx_context_save(ctx, state, sizeof(state)) != APTX_CONTEXT_SIZE) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        return 0;
+    }
+
+    /* Length of aptx_decode_sync() buffer is stored after magic, version and three state bytes */
+    state[9] = hd ? 6 : 4;
+    if (aptx_context_load(ctx2, state, sizeof(state))) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        return 0;
+    }
+    state[9] = 0;
+
+    /* Context ends with prediction of last subband of right channel: prev_sign[2], s_weight[2], ... */
+    state[APTX_CONTEXT_SIZE-320+3] ^= 2;
+    if (aptx_context_load(ctx2, state, sizeof(state))) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        return 0;
+    }
+    state[APTX_CONTEXT_SIZE-320+3] ^= 2;
+    state[APTX_CONTEXT_SIZE-320+8] ^= 0x40;
+    if (aptx_context_load(ctx2, state, sizeof(state))) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        return 0;
+    }
+    state[APTX_CONTEXT_SIZE-320+8] ^= 0x40;
+
+    if (!aptx_context_load(ctx2, state, sizeof(state))) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        return 0;
+    }
+    aptx_finish(ctx);
+
+    aptx_encode(ctx2, input + split, input_size - split, output->encoded + output->encoded_size, encoded_size - output->encoded_size, &written);
+    output->encoded_size += written;
+    if (!aptx_encode_finish(ctx2, output->encoded + output->encoded_size, encoded_size - output->encoded_size, &written)) {
+        aptx_finish(ctx2);
+        return 0;
+    }
+    output->encoded_size += written;
+
+    processed = aptx_decode(ctx2, output->encoded, split / (3*NB_CHANNELS*4) * (hd ? 6 : 4), output->decoded, check_decoded_size(output->encoded_size, hd), &written);
+    output->decoded_size = written;
+
+    ctx = aptx_context_clone(ctx2);
+    aptx_finish(ctx2);
+    if (!ctx)
+        return 0;
+
+    processed += aptx_decode(ctx, output->encoded + processed, output->encoded_size - processed, output->decoded + output->decoded_size, check_decoded_size(output->encoded_size, hd) - output->decoded_size, &written);
+    output->decoded_size += written;
+
+    aptx_finish(ctx);
+    return processed == output->encoded_size;
+}
+
+/*
+ * Build seek index while decoding and then seek into other context to the
+ * position in the middle of stream, between index entries, and decode the
+ * rest of stream again. Context of other codec variant must reject the index,
+ * while entry at start of stream and target before the first entry must not
+ * be reported as rejected.
+ */
+static int check_run_seek(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    const size_t interval = 1000 * sample_size;
+    struct aptx_context *ctx;
+    unsigned char *index, *start;
+    size_t ipos, length, written, index_size, target, offset, packets;
+    int rejected;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    index = check_alloc((output->encoded_size / interval + 1) * APTX_SEEK_ENTRY_SIZE);
+    index_size = 0;
+
+    output->decoded_size = 0;
+    for (ipos = 0; ipos < output->encoded_size; ipos += length) {
+        length = output->encoded_size - ipos;
+        if (length > interval)
+            length = interval;
+        if (aptx_decode(ctx, output->encoded + ipos, length, output->decoded + output->decoded_size, check_decoded_size(length, hd), &written) != length) {
+            aptx_finish(ctx);
+            free(index);
+            return 0;
+        }
+        output->decoded_size += written;
+        index_size += aptx_seek_entry(ctx, ipos + length, index + index_size, APTX_SEEK_ENTRY_SIZE);
+    }
+    aptx_finish(ctx);
+
+    packets = output->encoded_size / sample_size * 2 / 3;
+    target = packets * sample_size;
+
+    /* Index entries of other codec variant are rejected */
+    ctx = aptx_init(!hd);
+    if (!ctx || aptx_decode_seek(ctx, index, index_size, target, &rejected) != 0 || !rejected) {
+        aptx_finish(ctx);
+        free(index);
+        return 0;
+    }
+    aptx_finish(ctx);
+
+    ctx = aptx_init(hd);
+    if (!ctx) {
+        free(index);
+        return 0;
+    }
+
+    /* Valid entry at start of stream is not rejected */
+    start = check_alloc(APTX_SEEK_ENTRY_SIZE);
+    if (aptx_seek_entry(ctx, 0, start, APTX_SEEK_ENTRY_SIZE) != APTX_SEEK_ENTRY_SIZE ||
+        aptx_decode_seek(ctx, start, APTX_SEEK_ENTRY_SIZE, target, &rejected) != 0 || rejected) {
+        aptx_finish(ctx);
+        free(start);
+        free(index);
+        return 0;
+    }
+    free(start);
+
+    /* Target before the first entry has no entry to restore, which is not rejection */
+    if (aptx_decode_seek(ctx, index, index_size, 0, &rejected) != 0 || rejected) {
+        aptx_finish(ctx);
+        free(index);
+        return 0;
+    }
+
+    offset = aptx_decode_seek(ctx, index, index_size, target, &rejected);
+    free(index);
+    if (offset == 0 || rejected) {
+        aptx_finish(ctx);
+        return 0;
+    }
+
+    if (aptx_decode_skip(ctx, output->encoded + offset, target - offset) != target - offset) {
+        aptx_finish(ctx);
+        return 0;
+    }
+
+    /* Decoded output after seek continues at the same position as in the whole stream */
+    output->decoded_size = (packets >= (LATENCY_SAMPLES+3)/4) ? (4*packets - LATENCY_SAMPLES) * 3*NB_CHANNELS : 0;
+    if (aptx_decode(ctx, output->encoded + target, output->encoded_size - target, output->decoded + output->decoded_size, check_decoded_size(output->encoded_size - target, hd), &written) != output->encoded_size - target) {
+        aptx_finish(ctx);
+        return 0;
+    }
+    output->decoded_size += written;
+
+    aptx_finish(ctx);
+    return 1;
+}
+
+/*
+ * Skip first part of stream by aptx_decode_skip(), once by large buffer and
+ * once by buffer smaller than QMF synthesis history, and verify that state of
+ * context is same as after full decoding.
+ */
+static int check_run_skip(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    unsigned char state[APTX_CONTEXT_SIZE], skip_state[APTX_CONTEXT_SIZE];
+    struct aptx_context *ctx, *skip_ctx;
+    size_t written, target, first, packets;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    ctx = aptx_init(hd);
+    skip_ctx = aptx_init(hd);
+    if (!ctx || !skip_ctx) {
+        aptx_finish(ctx);
+        aptx_finish(skip_ctx);
+        return 0;
+    }
+
+    packets = output->encoded_size / sample_size * 2 / 3;
+    target = packets * sample_size;
+    first = (packets > 10) ? target - 10 * sample_size : 0;
+
+    if (aptx_decode(ctx, output->encoded, target, output->decoded, check_decoded_size(target, hd), &written) != target ||
+        aptx_decode_skip(skip_ctx, output->encoded, first) != first ||
+        aptx_decode_skip(skip_ctx, output->encoded + first, target - first) != target - first) {
+        aptx_finish(ctx);
+        aptx_finish(skip_ctx);
+        return 0;
+    }
+    output->decoded_size = written;
+
+    aptx_context_save(ctx, state, sizeof(state));
+    aptx_context_save(skip_ctx, skip_state, sizeof(skip_state));
+    aptx_finish(ctx);
+    if (memcmp(state, skip_state, sizeof(state)) != 0) {
+        aptx_finish(skip_ctx);
+        return 0;
+    }
+
+    if (aptx_decode(skip_ctx, output->encoded + target, output->encoded_size - target, output->decoded + output->decoded_size, check_decoded_size(output->encoded_size - target, hd), &written) != output->encoded_size - target) {
+        aptx_finish(skip_ctx);
+        return 0;
+    }
+    output->decoded_size += written;
+
+    aptx_finish(skip_ctx);
+    return 1;
+}
+
+/*
+ * Decode whole stream by aptx_decode_preview() and then encoded tone by it and
+ * by aptx_decode(). Preview of aptX sample p corresponds to full decoded
+ * output at 4p - 43.5 stereo samples (delay of LF subband in QMF analysis
+ * minus decoder latency), so at the rate of preview it has to match mean of
+ * full decoded stereo samples 4p - 44 and 4p - 43 of tone.
+ */
+static int check_run_preview(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    struct check_output tone;
+    struct aptx_context *ctx;
+    unsigned char *tone_input, *preview;
+    size_t tone_size, packets, written, p, i;
+    int32_t value, ref_value;
+    double signal_energy, error_energy;
+    int ret;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    packets = output->encoded_size / sample_size;
+    preview = check_alloc(packets * 3*NB_CHANNELS);
+    ret = aptx_decode_preview(ctx, output->encoded, output->encoded_size, preview, packets * 3*NB_CHANNELS, &written) == output->encoded_size &&
+          written == packets * 3*NB_CHANNELS;
+    free(preview);
+
+    tone_input = check_generate(&check_tone, &tone_size);
+    check_init_output(hd, tone_size, &tone);
+    ret = ret && check_run_portable(hd, tone_input, tone_size, &tone);
+    free(tone_input);
+
+    packets = tone.encoded_size / sample_size;
+    preview = check_alloc(packets * 3*NB_CHANNELS);
+    aptx_reset(ctx);
+    ret = ret && aptx_decode_preview(ctx, tone.encoded, tone.encoded_size, preview, packets * 3*NB_CHANNELS, &written) == tone.encoded_size &&
+          written == packets * 3*NB_CHANNELS;
+    aptx_finish(ctx);
+
+    /* Error has to be at least 50 dB below tone */
+    signal_energy = error_energy = 0;
+    for (p = 11; ret && 4*p - 43 < tone.decoded_size / (3*NB_CHANNELS); p++) {
+        for (i = 0; i < 3*NB_CHANNELS; i += 3) {
+            value = check_read_sample(preview + p*3*NB_CHANNELS + i);
+            ref_value = (check_read_sample(tone.decoded + (4*p - 44)*3*NB_CHANNELS + i) +
+                         check_read_sample(tone.decoded + (4*p - 43)*3*NB_CHANNELS + i)) / 2;
+            signal_energy += (double)ref_value * ref_value;
+            error_energy += (double)(value - ref_value) * (value - ref_value);
+        }
+    }
+
+    free(preview);
+    free(tone.encoded);
+    free(tone.decoded);
+    return ret && error_energy * 100000 <= signal_energy;
+}
+
+/*
+ * Measure levels of whole stream by aptx_decode_levels() and then levels of
+ * the middle half of encoded tone. Level difference of 12 dB between channels
+ * has to be about 480 in average factor_select of LF subband (approximately
+ * 40 per dB) and other subbands of tone have to be much quieter.
+ */
+static int check_run_levels(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    struct check_output tone;
+    struct aptx_levels levels;
+    struct aptx_context *ctx;
+    unsigned char *tone_input;
+    size_t tone_size, start, length;
+    unsigned long long average[NB_CHANNELS][NB_SUBBANDS];
+    unsigned channel, subband;
+    int ret;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    ret = aptx_decode_levels(ctx, output->encoded, output->encoded_size, &levels) == output->encoded_size &&
+          levels.packets == output->encoded_size / sample_size;
+
+    tone_input = check_generate(&check_tone, &tone_size);
+    check_init_output(hd, tone_size, &tone);
+    ret = ret && check_run_portable(hd, tone_input, tone_size, &tone);
+    free(tone_input);
+
+    /* Levels are measured continuously, so the first quarter only settles factor_select */
+    start = tone.encoded_size / sample_size / 4 * sample_size;
+    length = tone.encoded_size / sample_size / 2 * sample_size;
+    aptx_reset(ctx);
+    ret = ret && aptx_decode_levels(ctx, tone.encoded, start, &levels) == start &&
+          aptx_decode_levels(ctx, tone.encoded + start, length, &levels) == length &&
+          levels.packets == length / sample_size;
+    aptx_finish(ctx);
+    free(tone.encoded);
+    free(tone.decoded);
+
+    if (!ret)
+        return 0;
+
+    for (channel = 0; channel < NB_CHANNELS; channel++) {
+        for (subband = 0; subband < NB_SUBBANDS; subband++) {
+            average[channel][subband] = levels.factor_select_sum[channel][subband] / levels.packets;
+            if (levels.factor_select_peak[channel][subband] < average[channel][subband])
+                return 0;
+            if (subband > 0 && average[channel][subband] + 1000 > average[channel][0])
+                return 0;
+        }
+    }
+
+    return average[LEFT][0] >= average[RIGHT][0] + 400 && average[LEFT][0] <= average[RIGHT][0] + 560;
+}
+
+/*
+ * Transcode stream into the other codec variant by aptx_transcode() in chunks
+ * not aligned to aptX samples. Transcoded stream has to pass parity check of
+ * every aptX sample and its decoded output has same timing as the original
+ * decoded output. Its error against the original decoded output may be at
+ * most 3 dB above error of the other variant encoding the input directly (or
+ * below 4 LSB for nearly silent signals).
+ */
+static int check_run_transcode(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    const size_t other_size = hd ? 4 : 6;
+    struct aptx_context *decoder, *encoder;
+    struct aptx_stats stats;
+    unsigned char *transcoded, *decoded;
+    size_t packets, ipos, opos, length, written, i;
+    int32_t value, ref_value;
+    double error_energy, direct_energy;
+    struct check_output other;
+    int ret;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    decoder = aptx_init(hd);
+    encoder = aptx_init(!hd);
+    if (!decoder || !encoder) {
+        aptx_finish(decoder);
+        aptx_finish(encoder);
+        return 0;
+    }
+
+    packets = output->encoded_size / sample_size;
+    transcoded = check_alloc(packets * other_size);
+    decoded = check_alloc(output->decoded_size);
+
+    ret = 1;
+    for (ipos = 0, opos = 0; ret && ipos < output->encoded_size; ipos += length, opos += written) {
+        length = output->encoded_size - ipos;
+        if (length > 1001)
+            length = 1001;
+        length = aptx_transcode(decoder, encoder, output->encoded + ipos, length, transcoded + opos, packets * other_size - opos, &written);
+        ret = length > 0 && written == length / sample_size * other_size;
+    }
+    aptx_finish(decoder);
+    aptx_finish(encoder);
+
+    decoder = aptx_init(!hd);
+    ret = ret && decoder && opos == packets * other_size &&
+          aptx_decode(decoder, transcoded, opos, decoded, output->decoded_size, &written) == opos &&
+          written == output->decoded_size;
+    if (decoder) {
+        aptx_get_stats(decoder, &stats);
+        ret = ret && stats.parity_errors == 0 && stats.decoded == packets;
+        aptx_finish(decoder);
+    }
+
+    check_init_output(!hd, input_size, &other);
+    ret = ret && check_run_portable(!hd, input, input_size, &other) && other.decoded_size == output->decoded_size;
+
+    error_energy = direct_energy = 0;
+    for (i = 0; ret && i < output->decoded_size; i += 3) {
+        ref_value = check_read_sample(output->decoded + i);
+        value = check_read_sample(decoded + i);
+        error_energy += (double)(value - ref_value) * (value - ref_value);
+        value = check_read_sample(other.decoded + i);
+        direct_energy += (double)(value - ref_value) * (value - ref_value);
+    }
+
+    free(other.encoded);
+    free(other.decoded);
+    free(transcoded);
+    free(decoded);
+    return ret && error_energy <= 2 * direct_energy + 16.0 * output->decoded_size / 3;
+}
+
+/*
+ * Decode with analysis hook and verify it against the decoded output.
+ */
+static int check_run_analysis(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t encoded_size = check_encoded_size(input_size);
+    struct aptx_analysis analysis;
+    struct aptx_context *ctx;
+    size_t written, i;
+    unsigned long peak[NB_CHANNELS] = { 0, 0 };
+    int32_t value;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    aptx_encode(ctx, input, input_size, output->encoded, encoded_size, &written);
+    output->encoded_size = written;
+    if (!aptx_encode_finish(ctx, output->encoded + output->encoded_size, encoded_size - output->encoded_size, &written)) {
+        aptx_finish(ctx);
+        return 0;
+    }
+    output->encoded_size += written;
+
+    /* Output buffer may contain same decoded stream from previous variant */
+    memset(output->decoded, 0, check_decoded_size(output->encoded_size, hd));
+    aptx_set_analysis(ctx, &analysis);
+    if (aptx_decode(ctx, output->encoded, output->encoded_size, output->decoded, check_decoded_size(output->encoded_size, hd), &written) != output->encoded_size) {
+        aptx_finish(ctx);
+        return 0;
+    }
+    output->decoded_size = written;
+    aptx_finish(ctx);
+
+    for (i = 0; i < output->decoded_size; i += 3) {
+        value = sign_extend((int32_t)(output->decoded[i] | (output->decoded[i+1] << 8) | (output->decoded[i+2] << 16)), 24);
+        if (value < 0)
+            value = -value;
+        if (peak[i / 3 % NB_CHANNELS] < (unsigned long)value)
+            peak[i / 3 % NB_CHANNELS] = (unsigned long)value;
+    }
+
+    return analysis.hash == check_hash(output->decoded, output->decoded_size) &&
+           analysis.samples == output->decoded_size / (3*NB_CHANNELS) &&
+           analysis.peak[LEFT] == peak[LEFT] && analysis.peak[RIGHT] == peak[RIGHT];
+}
+
+/*
+ * Encode and decode in subband domain with QMF trees running outside of
+ * aptX context.
+ */
+static int check_run_subbands(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    const size_t packets = input_size / (3*NB_CHANNELS*4) + (LATENCY_SAMPLES+3)/4;
+    struct aptx_QMF_analysis qmf[NB_CHANNELS];
+    int32_t samples[NB_CHANNELS][4];
+    int32_t *subbands;
+    struct aptx_context *ctx;
+    size_t packet, ipos, written;
+    unsigned sample, channel, skip;
+
+    ctx = aptx_init(hd);
+    if (!ctx)
+        return 0;
+
+    subbands = check_alloc(packets * NB_CHANNELS*NB_SUBBANDS * sizeof(*subbands));
+
+    /* Input is followed by silence for flushing encoder latency like in aptx_encode_finish() */
+    memset(qmf, 0, sizeof(qmf));
+    for (packet = 0, ipos = 0; packet < packets; packet++) {
+        for (sample = 0; sample < 4; sample++) {
+            for (channel = 0; channel < NB_CHANNELS; channel++, ipos += 3) {
+                if (ipos + 3 <= input_size / (3*NB_CHANNELS*4) * (3*NB_CHANNELS*4))
+                    samples[channel][sample] = sign_extend((int32_t)(input[ipos] | (input[ipos+1] << 8) | (input[ipos+2] << 16)), 24);
+                else
+                    samples[channel][sample] = 0;
+            }
+        }
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            aptx_qmf_tree_analysis(&qmf[channel], samples[channel], &subbands[(packet*NB_CHANNELS + channel)*NB_SUBBANDS]);
+    }
+
+    if (aptx_encode_subbands(ctx, subbands, packets * NB_CHANNELS*NB_SUBBANDS, output->encoded, packets * sample_size, &written) != packets * NB_CHANNELS*NB_SUBBANDS) {
+        aptx_finish(ctx);
+        free(subbands);
+        return 0;
+    }
+    output->encoded_size = written;
+
+    aptx_reset(ctx);
+    if (aptx_decode_subbands(ctx, output->encoded, output->encoded_size, subbands, packets * NB_CHANNELS*NB_SUBBANDS, &written) != output->encoded_size) {
+        aptx_finish(ctx);
+        free(subbands);
+        return 0;
+    }
+    aptx_finish(ctx);
+
+    /* Skip decoder latency like aptx_decode() */
+    memset(qmf, 0, sizeof(qmf));
+    for (packet = 0; packet < written / (NB_CHANNELS*NB_SUBBANDS); packet++) {
+        for (channel = 0; channel < NB_CHANNELS; channel++)
+            aptx_qmf_tree_synthesis(&qmf[channel], &subbands[(packet*NB_CHANNELS + channel)*NB_SUBBANDS], samples[channel]);
+        if (packet + 1 < (LATENCY_SAMPLES+3)/4)
+            continue;
+        skip = (packet + 1 == (LATENCY_SAMPLES+3)/4) ? LATENCY_SAMPLES%4 : 0;
+        for (sample = skip; sample < 4; sample++) {
+            for (channel = 0; channel < NB_CHANNELS; channel++) {
+                output->decoded[output->decoded_size++] = (unsigned char)((uint32_t)samples[channel][sample] >>  0);
+                output->decoded[output->decoded_size++] = (unsigned char)((uint32_t)samples[channel][sample] >>  8);
+                output->decoded[output->decoded_size++] = (unsigned char)((uint32_t)samples[channel][sample] >> 16);
+            }
+        }
+    }
+
+    free(subbands);
+    return 1;
+}
+
+/*
+ * Encode by both codec variants at once with shared QMF analysis and verify
+ * that the other variant produces same stream as standalone encoder. State
+ * of the other context is loaded with shorter flush before finishing, so it
+ * has to stop after its own remaining samples.
+ */
+static int check_run_dual(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t encoded_size = check_encoded_size(input_size);
+    struct check_output other;
+    struct aptx_context *ctx, *ctx2;
+    unsigned char state[APTX_CONTEXT_SIZE];
+    unsigned char *encoded2;
+    size_t written, written2, encoded2_size;
+    int ret;
+
+    ctx = aptx_init(hd);
+    ctx2 = aptx_init(!hd);
+    if (!ctx || !ctx2) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        return 0;
+    }
+
+    encoded2 = check_alloc(encoded_size);
+
+    /* Small output buffer of the other variant splits encoding into more calls */
+    aptx_encode_dual(ctx, ctx2, input, input_size, output->encoded, encoded_size, &written, encoded2, 1000 * (hd ? 4 : 6), &written2);
+    output->encoded_size = written;
+    encoded2_size = written2;
+    aptx_encode_dual(ctx, ctx2, input + written2 / (hd ? 4 : 6) * 3*NB_CHANNELS*4, input_size - written2 / (hd ? 4 : 6) * 3*NB_CHANNELS*4, output->encoded + output->encoded_size, encoded_size - output->encoded_size, &written, encoded2 + encoded2_size, encoded_size - encoded2_size, &written2);
+    output->encoded_size += written;
+    encoded2_size += written2;
+
+    /* The other context flushes only one aptX sample, count of remaining samples is stored after magic, version and two state bytes */
+    if (aptx_context_save(ctx2, state, sizeof(state)) != APTX_CONTEXT_SIZE) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        free(encoded2);
+        return 0;
+    }
+    state[7] = 1;
+    if (!aptx_context_load(ctx2, state, sizeof(state))) {
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        free(encoded2);
+        return 0;
+    }
+
+    ret = aptx_encode_dual_finish(ctx, ctx2, output->encoded + output->encoded_size, encoded_size - output->encoded_size, &written, encoded2 + encoded2_size, encoded_size - encoded2_size, &written2);
+    output->encoded_size += written;
+    encoded2_size += written2;
+    ret = ret && written2 == (size_t)(!hd ? 6 : 4);
+    aptx_finish(ctx2);
+
+    if (ret)
+        ret = aptx_decode(ctx, output->encoded, output->encoded_size, output->decoded, check_decoded_size(output->encoded_size, hd), &written) == output->encoded_size;
+    output->decoded_size = written;
+    aptx_finish(ctx);
+
+    if (ret) {
+        check_init_output(!hd, input_size, &other);
+        ret = check_run_portable(!hd, input, input_size, &other) && other.encoded_size == encoded2_size + ((LATENCY_SAMPLES+3)/4 - 1) * (!hd ? 6 : 4) && memcmp(other.encoded, encoded2, encoded2_size) == 0;
+        free(other.encoded);
+        free(other.decoded);
+    }
+
+    free(encoded2);
+    return ret;
+}
+
+/*
+ * Probe misaligned window of 2048 bytes near the start of encoded stream. It
+ * has to find variant and position of parity sync, which starts at the first
+ * aptX sample of stream, with high confidence. When both channels of input
+ * are same (e.g. mono or silence), alignment shifted by one channel codeword
+ * passes parity check as well, so confidence may be low, but confident result
+ * still has to be right. Raw PCM input, random bytes and a window of only 60
+ * bytes must give low confidence and a window shorter than 53 bytes no result.
+ */
+static int check_run_probe(int hd, const unsigned char *input, size_t input_size, struct check_output *output)
+{
+    const size_t sample_size = hd ? 6 : 4;
+    unsigned char noise[2048];
+    size_t start, size, offset, i;
+    unsigned confidence;
+    int probe_hd, same;
+
+    if (!check_run_portable(hd, input, input_size, output))
+        return 0;
+
+    for (i = 0, same = 1; same && i + 3*NB_CHANNELS <= input_size; i += 3*NB_CHANNELS)
+        same = memcmp(input + i, input + i + 3, 3) == 0;
+
+    start = 32 * sample_size + 3 * sample_size + 1;
+    size = output->encoded_size - start;
+    if (size > 2048)
+        size = 2048;
+
+    if (!aptx_probe(output->encoded + start, size, &probe_hd, &offset, &confidence))
+        return 0;
+    if (!same && confidence < 70)
+        return 0;
+    if (confidence >= 50 && (probe_hd != hd || (start + offset) % (8 * sample_size) != 0))
+        return 0;
+
+    if (!aptx_probe(output->encoded + start, 60, &probe_hd, &offset, &confidence) || confidence >= 20)
+        return 0;
+    if (aptx_probe(output->encoded + start, 52, &probe_hd, &offset, &confidence))
+        return 0;
+
+    size = input_size / 2;
+    if (size > 2048)
+        size = 2048;
+    if (!aptx_probe(input + input_size / 2 - size / 2, size, &probe_hd, &offset, &confidence) || confidence >= 20)
+        return 0;
+
+    check_seed = 7;
+    for (i = 0; i < sizeof(noise); i++)
+        noise[i] = (unsigned char)check_random(8);
+    return aptx_probe(noise, sizeof(noise), &probe_hd, &offset, &confidence) && confidence < 20;
+}
+
+static const struct check_variant check_variants[] = {
+    { "portable",    check_run_portable },
+    { "packet",      check_run_packet },
+    { "block",       check_run_block },
+    { "decode_sync", check_run_decode_sync },
+    { "realign",     check_run_realign },
+    { "tolerance",   check_run_tolerance },
+    { "bit_errors",  check_run_bit_errors },
+    { "conceal",     check_run_conceal },
+    { "context",     check_run_context },
+    { "seek",        check_run_seek },
+    { "skip",        check_run_skip },
+    { "preview",     check_run_preview },
+    { "levels",      check_run_levels },
+    { "transcode",   check_run_transcode },
+    { "analysis",    check_run_analysis },
+    { "subbands",    check_run_subbands },
+    { "dual",        check_run_dual },
+    { "probe",       check_run_probe },
+};
+
+static const struct check_golden *check_find_golden(const char *name, int hd)
+{
+    size_t i;
+    for (i = 0; i < ARRAY_SIZE(check_goldens); i++)
+        if (check_goldens[i].name && strcmp(check_goldens[i].name, name) == 0 && check_goldens[i].hd == hd)
+            return &check_goldens[i];
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const variant_names[2] = { "aptX", "aptX HD" };
+    const struct check_golden *golden;
+    struct check_output reference, output;
+    unsigned char *input;
+    size_t input_size;
+    int generate = 0;
+    int failed = 0;
+    size_t s, v;
+    int hd;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            fprintf(stderr, "aptX codec conformance check %d.%d.%d\n", OPENAPTX_MAJOR, OPENAPTX_MINOR, OPENAPTX_PATCH);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "This utility encodes and decodes reference corpus by aptX\n");
+            fprintf(stderr, "and aptX HD, compares output with golden values and checks\n");
+            fprintf(stderr, "that every alternative code path is bit identical\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Usage:\n");
+            fprintf(stderr, "        %s [options]\n", argv[0]);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Options:\n");
+            fprintf(stderr, "        -h, --help   Display this help\n");
+            fprintf(stderr, "        --generate   Print golden values table for current code\n");
+            return 1;
+        } else if (strcmp(argv[i], "--generate") == 0) {
+            generate = 1;
+        } else {
+            fprintf(stderr, "%s: Invalid option %s\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+
+    for (s = 0; s < ARRAY_SIZE(check_signals); s++) {
+        input = check_generate(&check_signals[s], &input_size);
+
+        for (hd = 0; hd < 2; hd++) {
+            check_init_output(hd, input_size, &reference);
+            if (!check_variants[0].run(hd, input, input_size, &reference)) {
+                printf("FAIL %s %s %s: processing failed\n", check_signals[s].name, variant_names[hd], check_variants[0].name);
+                failed = 1;
+                free(reference.encoded);
+                free(reference.decoded);
+                continue;
+            }
+
+            if (generate) {
+                printf("    { \"%s\", %d, %lu, UINT64_C(0x%016llx), %lu, UINT64_C(0x%016llx) },\n", check_signals[s].name, hd,
+                       (unsigned long)reference.encoded_size, (unsigned long long)check_hash(reference.encoded, reference.encoded_size),
+                       (unsigned long)reference.decoded_size, (unsigned long long)check_hash(reference.decoded, reference.decoded_size));
+            } else {
+                golden = check_find_golden(check_signals[s].name, hd);
+                if (!golden) {
+                    printf("FAIL %s %s: missing golden values\n", check_signals[s].name, variant_names[hd]);
+                    failed = 1;
+                } else if (golden->encoded_size != reference.encoded_size || golden->encoded_hash != check_hash(reference.encoded, reference.encoded_size)) {
+                    printf("FAIL %s %s: encoded stream differs from golden\n", check_signals[s].name, variant_names[hd]);
+                    failed = 1;
+                } else if (golden->decoded_size != reference.decoded_size || golden->decoded_hash != check_hash(reference.decoded, reference.decoded_size)) {
+                    printf("FAIL %s %s: decoded stream differs from golden\n", check_signals[s].name, variant_names[hd]);
+                    failed = 1;
+                } else {
+                    printf("ok   %s %s %s\n", check_signals[s].name, variant_names[hd], check_variants[0].name);
+                }
+            }
+
+            for (v = 1; v < ARRAY_SIZE(check_variants) && !generate; v++) {
+                check_init_output(hd, input_size, &output);
+                if (!check_variants[v].run(hd, input, input_size, &output)) {
+                    printf("FAIL %s %s %s: processing failed\n", check_signals[s].name, variant_names[hd], check_variants[v].name);
+                    failed = 1;
+                } else if (output.encoded_size != reference.encoded_size || memcmp(output.encoded, reference.encoded, output.encoded_size) != 0) {
+                    printf("FAIL %s %s %s: encoded stream differs from portable\n", check_signals[s].name, variant_names[hd], check_variants[v].name);
+                    failed = 1;
+                } else if (output.decoded_size != reference.decoded_size || memcmp(output.decoded, reference.decoded, output.decoded_size) != 0) {
+                    printf("FAIL %s %s %s: decoded stream differs from portable\n", check_signals[s].name, variant_names[hd], check_variants[v].name);
+                    failed = 1;
+                } else {
+                    printf("ok   %s %s %s\n", check_signals[s].name, variant_names[hd], check_variants[v].name);
+                }
+                free(output.encoded);
+                free(output.decoded);
+            }
+
+            free(reference.encoded);
+            free(reference.decoded);
+        }
+
+        free(input);
+    }
+
+    return failed;
+}
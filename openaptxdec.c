@@ -19,7 +19,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef _WIN32
@@ -32,6 +34,47 @@
 static unsigned char input_buffer[512*6];
 static unsigned char output_buffer[512*3*2*6+3*2*4];
 
+static unsigned char *read_index(const char *name, size_t *size)
+{
+    FILE *file;
+    unsigned char *index;
+    unsigned char *new_index;
+    size_t allocated;
+    size_t length;
+
+    file = fopen(name, "rb");
+    if (!file)
+        return NULL;
+
+    index = NULL;
+    allocated = 0;
+    length = 0;
+
+    while (!feof(file) && !ferror(file)) {
+        if (length == allocated) {
+            allocated += 64*APTX_SEEK_ENTRY_SIZE;
+            new_index = realloc(index, allocated);
+            if (!new_index) {
+                free(index);
+                fclose(file);
+                return NULL;
+            }
+            index = new_index;
+        }
+        length += fread(index + length, 1, allocated - length, file);
+    }
+
+    if (ferror(file)) {
+        free(index);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = length;
+    return index;
+}
+
 int main(int argc, char *argv[])
 {
     int i;
@@ -43,6 +86,25 @@ int main(int argc, char *argv[])
     size_t dropped;
     int synced;
     int syncing;
+    int probe_hd;
+    size_t probe_offset;
+    unsigned confidence;
+    int stats;
+    int analyze;
+    unsigned long tolerance;
+    int seek;
+    char *end;
+    double seek_time;
+    const char *index_name;
+    unsigned char *index;
+    size_t index_size;
+    size_t sample_size;
+    size_t offset;
+    size_t target;
+    int rejected;
+    size_t size;
+    struct aptx_stats aptx_stats;
+    struct aptx_analysis analysis;
     struct aptx_context *ctx;
 
 #ifdef _WIN32
@@ -51,6 +113,12 @@ int main(int argc, char *argv[])
 #endif
 
     hd = 0;
+    stats = 0;
+    analyze = 0;
+    tolerance = 0;
+    seek = 0;
+    seek_time = 0;
+    index_name = NULL;
 
     for (i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -70,6 +138,13 @@ int main(int argc, char *argv[])
             fprintf(stderr, "Options:\n");
             fprintf(stderr, "        -h, --help   Display this help\n");
             fprintf(stderr, "        --hd         Decode from aptX HD\n");
+            fprintf(stderr, "        --stats      Print decoding statistics at the end\n");
+            fprintf(stderr, "        --analyze    Print peak, RMS, clipping and hash of decoded output\n");
+            fprintf(stderr, "        --tolerance N\n");
+            fprintf(stderr, "                     Pass through aptX samples with bit errors unless there\n");
+            fprintf(stderr, "                     are more than N errors in last 16 aptX samples (max 15)\n");
+            fprintf(stderr, "        --seek SECS  Start decoding at time SECS seconds\n");
+            fprintf(stderr, "        --index FILE Use seek index FILE created by openaptxindex\n");
             fprintf(stderr, "\n");
             fprintf(stderr, "Examples:\n");
             fprintf(stderr, "\n");
@@ -77,10 +152,32 @@ int main(int argc, char *argv[])
             fprintf(stderr, "\n");
             fprintf(stderr, "        %s --hd < sample.aptxhd > sample.s24le\n", argv[0]);
             fprintf(stderr, "\n");
+            fprintf(stderr, "        openaptxindex < sample.aptx > sample.aptx.idx\n");
+            fprintf(stderr, "        %s --index sample.aptx.idx --seek 120 < sample.aptx > sample.s24le\n", argv[0]);
+            fprintf(stderr, "\n");
             fprintf(stderr, "        %s < sample.aptx | play -t raw -r 44.1k -L -e s -b 24 -c 2 -\n", argv[0]);
             return 1;
         } else if (strcmp(argv[i], "--hd") == 0) {
             hd = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--analyze") == 0) {
+            analyze = 1;
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i+1 < argc) {
+            tolerance = strtoul(argv[++i], &end, 10);
+            if (*end || tolerance > 15) {
+                fprintf(stderr, "%s: Invalid tolerance %s\n", argv[0], argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--seek") == 0 && i+1 < argc) {
+            seek_time = strtod(argv[++i], &end);
+            if (*end || !(seek_time >= 0)) {
+                fprintf(stderr, "%s: Invalid seek time %s\n", argv[0], argv[i]);
+                return 1;
+            }
+            seek = 1;
+        } else if (strcmp(argv[i], "--index") == 0 && i+1 < argc) {
+            index_name = argv[++i];
         } else {
             fprintf(stderr, "%s: Invalid option %s\n", argv[0], argv[i]);
             return 1;
@@ -96,24 +193,107 @@ int main(int argc, char *argv[])
     /*
      * Try to guess type of input stream based on the first six bytes
      * Encoder produces fixed first sample because aptX predictor has fixed values
+     * Stream captured from the middle is recognized by parity statistics
      */
-    length = fread(input_buffer, 1, 6, stdin);
+    length = fread(input_buffer, 1, 512, stdin);
     if (length >= 4 && memcmp(input_buffer, "\x4b\xbf\x4b\xbf", 4) == 0) {
         if (hd)
             fprintf(stderr, "%s: Input looks like start of aptX audio stream (not aptX HD), try without --hd\n", argv[0]);
     } else if (length >= 6 && memcmp(input_buffer, "\x73\xbe\xff\x73\xbe\xff", 6) == 0) {
         if (!hd)
             fprintf(stderr, "%s: Input looks like start of aptX HD audio stream, try with --hd\n", argv[0]);
+    } else if (length >= 4 && memcmp(input_buffer, "\x6b\xbf\x6b\xbf", 4) == 0) {
+        fprintf(stderr, "%s: Input looks like start of standard aptX audio stream, which is not supported yet\n", argv[0]);
+    } else if (aptx_probe(input_buffer, length, &probe_hd, &probe_offset, &confidence) && confidence >= 50) {
+        if (probe_hd && !hd)
+            fprintf(stderr, "%s: Input looks like aptX HD audio stream, try with --hd\n", argv[0]);
+        else if (!probe_hd && hd)
+            fprintf(stderr, "%s: Input looks like aptX audio stream (not aptX HD), try without --hd\n", argv[0]);
     } else {
-        if (length >= 4 && memcmp(input_buffer, "\x6b\xbf\x6b\xbf", 4) == 0)
-            fprintf(stderr, "%s: Input looks like start of standard aptX audio stream, which is not supported yet\n", argv[0]);
-        else
-            fprintf(stderr, "%s: Input does not look like start of aptX nor aptX HD audio stream\n", argv[0]);
+        fprintf(stderr, "%s: Input does not look like aptX nor aptX HD audio stream\n", argv[0]);
     }
 
     ret = 0;
     syncing = 0;
 
+    if (analyze)
+        aptx_set_analysis(ctx, &analysis);
+
+    aptx_set_error_tolerance(ctx, (unsigned)tolerance);
+
+    if (seek) {
+        index = NULL;
+        index_size = 0;
+        if (index_name) {
+            index = read_index(index_name, &index_size);
+            if (!index) {
+                fprintf(stderr, "%s: Cannot read seek index %s\n", argv[0], index_name);
+                aptx_finish(ctx);
+                return 1;
+            }
+        }
+
+        /* One aptX sample contains 4 stereo samples at 44.1 kHz */
+        sample_size = hd ? 6 : 4;
+        target = (size_t)(seek_time * 44100 / 4) * sample_size;
+        offset = aptx_decode_seek(ctx, index, index_size, target, &rejected);
+
+        /* Seek index entry at or before target is rejected when it was created for other codec variant or is damaged */
+        if (rejected) {
+            fprintf(stderr, "%s: Seek index %s does not match %s audio stream, try %s --hd\n", argv[0], index_name, hd ? "aptX HD" : "aptX", hd ? "without" : "with");
+            free(index);
+            aptx_finish(ctx);
+            return 1;
+        }
+        free(index);
+
+        /* Skip input up to the restored index position, first bytes were already read */
+        if (offset >= length) {
+            if (fseek(stdin, (long)offset, SEEK_SET) != 0) {
+                for (size = offset - length; size > 0 && !feof(stdin) && !ferror(stdin); size -= length)
+                    length = fread(input_buffer, 1, size < sizeof(input_buffer) ? size : sizeof(input_buffer), stdin);
+            }
+            length = 0;
+        } else {
+            length -= offset;
+            memmove(input_buffer, input_buffer + offset, length);
+        }
+
+        /* Decode remaining input up to the requested position without producing decoded samples */
+        while (offset < target) {
+            if (length < sample_size) {
+                size = fread(input_buffer + length, 1, sizeof(input_buffer) - length, stdin);
+                if (size == 0)
+                    break;
+                length += size;
+                continue;
+            }
+            size = length / sample_size * sample_size;
+            if (size > target - offset)
+                size = target - offset;
+            processed = aptx_decode_skip(ctx, input_buffer, size);
+            if (processed != size) {
+                fprintf(stderr, "%s: aptX decoding failed while seeking\n", argv[0]);
+                aptx_finish(ctx);
+                return 1;
+            }
+            offset += size;
+            length -= size;
+            memmove(input_buffer, input_buffer + size, length);
+        }
+
+        if (ferror(stdin)) {
+            fprintf(stderr, "%s: aptX decoding failed to read input data\n", argv[0]);
+            aptx_finish(ctx);
+            return 1;
+        }
+
+        if (offset < target)
+            fprintf(stderr, "%s: Seek position is after the end of aptX audio stream\n", argv[0]);
+        else if (length == 0)
+            length = fread(input_buffer, 1, sizeof(input_buffer), stdin);
+    }
+
     while (length > 0) {
         processed = aptx_decode_sync(ctx, input_buffer, length, output_buffer, sizeof(output_buffer), &written, &synced, &dropped);
 
@@ -188,6 +368,17 @@ int main(int argc, char *argv[])
         ret = 1;
     }
 
+    if (analyze) {
+        for (i = 0; i < 2; i++)
+            fprintf(stderr, "%s: %s channel peak %lu, RMS %.1f, clipped %llu samples\n", argv[0], i ? "Right" : "Left", analysis.peak[i], analysis.samples ? sqrt(analysis.sum_squares[i] / (double)analysis.samples) : 0.0, analysis.clipped[i]);
+        fprintf(stderr, "%s: Decoded %llu samples with hash %016llx\n", argv[0], analysis.samples, analysis.hash);
+    }
+
+    if (stats) {
+        aptx_get_stats(ctx, &aptx_stats);
+        fprintf(stderr, "%s: Decoded %llu aptX samples with valid parity, %llu parity errors (%llu tolerated), synchronization lost %llu times and regained %llu times, realigned %llu times, dropped %llu bytes\n", argv[0], aptx_stats.decoded, aptx_stats.parity_errors, aptx_stats.tolerated, aptx_stats.sync_lost, aptx_stats.sync_regained, aptx_stats.realigned, aptx_stats.dropped);
+    }
+
     aptx_finish(ctx);
     return ret;
 }
@@ -31,6 +31,7 @@
 
 static unsigned char input_buffer[512*3*2*4];
 static unsigned char output_buffer[512*6];
+static unsigned char output2_buffer[512*6];
 
 int main(int argc, char *argv[])
 {
@@ -40,7 +41,11 @@ int main(int argc, char *argv[])
     size_t length;
     size_t processed;
     size_t written;
+    size_t written2;
+    const char *dual_name;
+    FILE *dual;
     struct aptx_context *ctx;
+    struct aptx_context *ctx2;
 
 #ifdef _WIN32
     _setmode(_fileno(stdin), _O_BINARY);
@@ -48,6 +53,7 @@ int main(int argc, char *argv[])
 #endif
 
     hd = 0;
+    dual_name = NULL;
 
     for (i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -62,6 +68,7 @@ int main(int argc, char *argv[])
             fprintf(stderr, "Options:\n");
             fprintf(stderr, "        -h, --help   Display this help\n");
             fprintf(stderr, "        --hd         Encode to aptX HD\n");
+            fprintf(stderr, "        --dual FILE  Encode also to the other variant into FILE\n");
             fprintf(stderr, "\n");
             fprintf(stderr, "Examples:\n");
             fprintf(stderr, "\n");
@@ -69,19 +76,37 @@ int main(int argc, char *argv[])
             fprintf(stderr, "\n");
             fprintf(stderr, "        %s --hd < sample.s24le > sample.aptxhd\n", argv[0]);
             fprintf(stderr, "\n");
+            fprintf(stderr, "        %s --dual sample.aptxhd < sample.s24le > sample.aptx\n", argv[0]);
+            fprintf(stderr, "\n");
             fprintf(stderr, "        sox sample.wav -t raw -r 44.1k -L -e s -b 24 -c 2 - | %s > sample.aptx\n", argv[0]);
             return 1;
         } else if (strcmp(argv[i], "--hd") == 0) {
             hd = 1;
+        } else if (strcmp(argv[i], "--dual") == 0 && i+1 < argc) {
+            dual_name = argv[++i];
         } else {
             fprintf(stderr, "%s: Invalid option %s\n", argv[0], argv[i]);
             return 1;
         }
     }
 
+    dual = NULL;
+    if (dual_name) {
+        dual = fopen(dual_name, "wb");
+        if (!dual) {
+            fprintf(stderr, "%s: Cannot open output file %s\n", argv[0], dual_name);
+            return 1;
+        }
+    }
+
     ctx = aptx_init(hd);
-    if (!ctx) {
+    ctx2 = dual ? aptx_init(!hd) : NULL;
+    if (!ctx || (dual && !ctx2)) {
         fprintf(stderr, "%s: Cannot initialize aptX encoder\n", argv[0]);
+        aptx_finish(ctx);
+        aptx_finish(ctx2);
+        if (dual)
+            fclose(dual);
         return 1;
     }
 
@@ -95,12 +120,15 @@ int main(int argc, char *argv[])
         }
         if (length == 0)
             break;
-        processed = aptx_encode(ctx, input_buffer, length, output_buffer, sizeof(output_buffer), &written);
+        if (dual)
+            processed = aptx_encode_dual(ctx, ctx2, input_buffer, length, output_buffer, sizeof(output_buffer), &written, output2_buffer, sizeof(output2_buffer), &written2);
+        else
+            processed = aptx_encode(ctx, input_buffer, length, output_buffer, sizeof(output_buffer), &written);
         if (processed != length) {
             fprintf(stderr, "%s: aptX encoding stopped in the middle of the sample, dropped %lu byte%s\n", argv[0], (unsigned long)(length-processed), (length-processed != 1) ? "s" : "");
             ret = 1;
         }
-        if (fwrite(output_buffer, 1, written, stdout) != written) {
+        if (fwrite(output_buffer, 1, written, stdout) != written || (dual && fwrite(output2_buffer, 1, written2, dual) != written2)) {
             fprintf(stderr, "%s: aptX encoding failed to write encoded data\n", argv[0]);
             ret = 1;
             break;
@@ -109,7 +137,18 @@ int main(int argc, char *argv[])
             break;
     }
 
-    if (aptx_encode_finish(ctx, output_buffer, sizeof(output_buffer), &written)) {
+    if (dual) {
+        if (aptx_encode_dual_finish(ctx, ctx2, output_buffer, sizeof(output_buffer), &written, output2_buffer, sizeof(output2_buffer), &written2)) {
+            if (fwrite(output_buffer, 1, written, stdout) != written || fwrite(output2_buffer, 1, written2, dual) != written2) {
+                fprintf(stderr, "%s: aptX encoding failed to write encoded data\n", argv[0]);
+                ret = 1;
+            }
+        }
+        if (fclose(dual) != 0) {
+            fprintf(stderr, "%s: aptX encoding failed to write encoded data\n", argv[0]);
+            ret = 1;
+        }
+    } else if (aptx_encode_finish(ctx, output_buffer, sizeof(output_buffer), &written)) {
         if (fwrite(output_buffer, 1, written, stdout) != written) {
             fprintf(stderr, "%s: aptX encoding failed to write encoded data\n", argv[0]);
             ret = 1;
@@ -117,5 +156,6 @@ int main(int argc, char *argv[])
     }
 
     aptx_finish(ctx);
+    aptx_finish(ctx2);
     return ret;
 }
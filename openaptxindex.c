@@ -0,0 +1,170 @@
+/*
+ * aptX seek index utility
+ * Copyright (C) 2018-2021  Pali Rohár <pali.rohar@gmail.com>
+ *
+ * Read README file for license details.  Due to license abuse
+ * this program must not be used in any Freedesktop project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include <openaptx.h>
+
+static unsigned char input_buffer[512*6];
+static unsigned char output_buffer[512*3*2*6];
+static unsigned char entry_buffer[APTX_SEEK_ENTRY_SIZE];
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int hd;
+    int ret;
+    char *end;
+    double interval;
+    size_t sample_size;
+    size_t interval_size;
+    size_t offset;
+    size_t next;
+    size_t length;
+    size_t pos;
+    size_t size;
+    size_t processed;
+    size_t written;
+    size_t entries;
+    struct aptx_context *ctx;
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    hd = 0;
+    interval = 10;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            fprintf(stderr, "aptX seek index utility %d.%d.%d (using libopenaptx %d.%d.%d)\n", OPENAPTX_MAJOR, OPENAPTX_MINOR, OPENAPTX_PATCH, aptx_major, aptx_minor, aptx_patch);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "This utility decodes aptX or aptX HD audio stream from stdin\n");
+            fprintf(stderr, "and writes seek index with decoder state snapshots to stdout\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Seek index is used by openaptxdec --index option\n");
+            fprintf(stderr, "Input must be undamaged aptX audio stream\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Usage:\n");
+            fprintf(stderr, "        %s [options]\n", argv[0]);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Options:\n");
+            fprintf(stderr, "        -h, --help              Display this help\n");
+            fprintf(stderr, "        --hd                    Index aptX HD stream\n");
+            fprintf(stderr, "        --interval SECONDS      Store snapshot every SECONDS (default 10)\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Examples:\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "        %s < sample.aptx > sample.aptx.idx\n", argv[0]);
+            fprintf(stderr, "        openaptxdec --index sample.aptx.idx --seek 120 < sample.aptx > sample.s24le\n");
+            return 1;
+        } else if (strcmp(argv[i], "--hd") == 0) {
+            hd = 1;
+        } else if (strcmp(argv[i], "--interval") == 0 && i+1 < argc) {
+            interval = strtod(argv[++i], &end);
+            if (*end || !(interval > 0)) {
+                fprintf(stderr, "%s: Invalid interval %s\n", argv[0], argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "%s: Invalid option %s\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+
+    /* One aptX sample contains 4 stereo samples at 44.1 kHz */
+    sample_size = hd ? 6 : 4;
+    interval_size = (size_t)(interval * 44100 / 4) * sample_size;
+    if (interval_size == 0)
+        interval_size = sample_size;
+
+    ctx = aptx_init(hd);
+    if (!ctx) {
+        fprintf(stderr, "%s: Cannot initialize aptX decoder\n", argv[0]);
+        return 1;
+    }
+
+    ret = 0;
+    offset = 0;
+    next = interval_size;
+    entries = 0;
+    length = 0;
+
+    while (!feof(stdin)) {
+        length += fread(input_buffer + length, 1, sizeof(input_buffer) - length, stdin);
+        if (ferror(stdin)) {
+            fprintf(stderr, "%s: aptX decoding failed to read input data\n", argv[0]);
+            ret = 1;
+            break;
+        }
+
+        /* Decode whole aptX samples, but stop exactly on each index position */
+        pos = 0;
+        while (length - pos >= sample_size) {
+            size = (length - pos) / sample_size * sample_size;
+            if (size > next - offset)
+                size = next - offset;
+
+            processed = aptx_decode(ctx, input_buffer + pos, size, output_buffer, sizeof(output_buffer), &written);
+            pos += processed;
+            offset += processed;
+            if (processed != size) {
+                fprintf(stderr, "%s: aptX decoding failed at offset %lu, input is damaged\n", argv[0], (unsigned long)offset);
+                ret = 1;
+                break;
+            }
+
+            if (offset == next) {
+                size = aptx_seek_entry(ctx, offset, entry_buffer, sizeof(entry_buffer));
+                if (fwrite(entry_buffer, 1, size, stdout) != size) {
+                    fprintf(stderr, "%s: failed to write seek index\n", argv[0]);
+                    ret = 1;
+                    break;
+                }
+                entries++;
+                next += interval_size;
+            }
+        }
+
+        if (ret)
+            break;
+
+        /* Keep incomplete aptX sample for next read */
+        length -= pos;
+        memmove(input_buffer, input_buffer + pos, length);
+    }
+
+    if (!ret && length)
+        fprintf(stderr, "%s: aptX stream ends in the middle of the sample, ignoring last %lu byte%s\n", argv[0], (unsigned long)length, (length != 1) ? "s" : "");
+
+    fprintf(stderr, "%s: Stored %lu seek index entr%s\n", argv[0], (unsigned long)entries, (entries != 1) ? "ies" : "y");
+
+    aptx_finish(ctx);
+    return ret;
+}
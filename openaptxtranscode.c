@@ -0,0 +1,142 @@
+/*
+ * aptX transcoder utility
+ * Copyright (C) 2018-2021  Pali Rohár <pali.rohar@gmail.com>
+ *
+ * Read README file for license details.  Due to license abuse
+ * this program must not be used in any Freedesktop project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include <openaptx.h>
+
+static unsigned char input_buffer[512*6];
+static unsigned char output_buffer[512*6*6/4];
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int from_hd;
+    int to_hd;
+    int ret;
+    size_t sample_size;
+    size_t length;
+    size_t processed;
+    size_t written;
+    struct aptx_context *decoder;
+    struct aptx_context *encoder;
+
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    from_hd = 0;
+    to_hd = 1;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            fprintf(stderr, "aptX transcoder utility %d.%d.%d (using libopenaptx %d.%d.%d)\n", OPENAPTX_MAJOR, OPENAPTX_MINOR, OPENAPTX_PATCH, aptx_major, aptx_minor, aptx_patch);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "This utility transcodes aptX audio stream from stdin\n");
+            fprintf(stderr, "to aptX HD audio stream on stdout or vice versa\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Transcoding is done directly in subband domain\n");
+            fprintf(stderr, "without decoding to raw audio samples\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Usage:\n");
+            fprintf(stderr, "        %s [options]\n", argv[0]);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Options:\n");
+            fprintf(stderr, "        -h, --help   Display this help\n");
+            fprintf(stderr, "        --to-hd      Transcode from aptX to aptX HD (default)\n");
+            fprintf(stderr, "        --from-hd    Transcode from aptX HD to aptX\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Examples:\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "        %s < sample.aptx > sample.aptxhd\n", argv[0]);
+            fprintf(stderr, "\n");
+            fprintf(stderr, "        %s --from-hd < sample.aptxhd > sample.aptx\n", argv[0]);
+            return 1;
+        } else if (strcmp(argv[i], "--to-hd") == 0) {
+            from_hd = 0;
+            to_hd = 1;
+        } else if (strcmp(argv[i], "--from-hd") == 0) {
+            from_hd = 1;
+            to_hd = 0;
+        } else {
+            fprintf(stderr, "%s: Invalid option %s\n", argv[0], argv[i]);
+            return 1;
+        }
+    }
+
+    decoder = aptx_init(from_hd);
+    encoder = aptx_init(to_hd);
+    if (!decoder || !encoder) {
+        fprintf(stderr, "%s: Cannot initialize aptX transcoder\n", argv[0]);
+        aptx_finish(decoder);
+        aptx_finish(encoder);
+        return 1;
+    }
+
+    sample_size = from_hd ? 6 : 4;
+    ret = 0;
+    length = 0;
+
+    while (!feof(stdin)) {
+        length += fread(input_buffer + length, 1, sizeof(input_buffer) - length, stdin);
+        if (ferror(stdin)) {
+            fprintf(stderr, "%s: aptX transcoding failed to read input data\n", argv[0]);
+            ret = 1;
+            break;
+        }
+
+        processed = aptx_transcode(decoder, encoder, input_buffer, length, output_buffer, sizeof(output_buffer), &written);
+
+        if (written > 0) {
+            if (fwrite(output_buffer, 1, written, stdout) != written) {
+                fprintf(stderr, "%s: aptX transcoding failed to write transcoded data\n", argv[0]);
+                ret = 1;
+                break;
+            }
+        }
+
+        /* Only incomplete aptX sample may stay unprocessed */
+        if (length - processed >= sample_size) {
+            fprintf(stderr, "%s: aptX decoding failed, input is damaged\n", argv[0]);
+            ret = 1;
+            break;
+        }
+
+        length -= processed;
+        memmove(input_buffer, input_buffer + processed, length);
+    }
+
+    if (!ret && length) {
+        fprintf(stderr, "%s: aptX stream ends in the middle of the sample, dropped %lu byte%s\n", argv[0], (unsigned long)length, (length != 1) ? "s" : "");
+        ret = 1;
+    }
+
+    aptx_finish(decoder);
+    aptx_finish(encoder);
+    return ret;
+}